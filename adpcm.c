@@ -3,6 +3,8 @@
 // RW 040314
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "adpcm.h"
 
 #define DEBUG (0)
@@ -10,6 +12,33 @@
 #define DELTA_SIGNBIT  (64)
 #define DELTA_MAX      (63)
 
+// Decoder statistics, per thread
+__thread unsigned long frames_decoded = 0;
+__thread unsigned long frames_constant = 0;
+
+// Frame cache: open addressed, FRAMECACHE_PROBES slots tried from the
+// frame's hash. If all are taken by other frames, the first is replaced.
+#define FRAMECACHE_SIZE   (2048)
+#define FRAMECACHE_PROBES (4)
+
+struct framecache_entry
+{
+  unsigned long long hash;           // 0 if entry unused
+  unsigned char frame[FRAMESIZE];
+  short samples[FRAMESIZE];
+};
+
+int frame_cache = 0;
+__thread unsigned long cache_hits = 0;
+__thread unsigned long cache_misses = 0;
+static __thread struct framecache_entry *framecache = NULL;
+
+__thread struct decoderprofile *decoder_profile = NULL;
+
+// newstep() results: step size clamped at maxdiffptr or tableend
+#define NEWSTEP_MAXDIFF  (1)
+#define NEWSTEP_TABLEEND (2)
+
 // ADPCM table sizes
 #define TABLES     (4)
 #define TABLESIZE  (64)
@@ -102,11 +131,22 @@ void unpackbuf(unsigned char inbuf[FRAMESIZE],
 long scale(long delta, long stepsize);
 void set_initialstate(struct adpcmstate *state);
 int direction(long *curval, struct adpcmstate *state);
-void newstep(int valcase, int sign, int delta, struct adpcmstate *state);
+int newstep(int valcase, int sign, int delta, struct adpcmstate *state);
 long update(long curval, long diff, int sign);
+long checkframes(unsigned char *frames, long count);
+void frame_envelope(unsigned char frame[FRAMESIZE], 
+                    short *minval, short *maxval);
+int constant_frame(unsigned char deltas[FRAMESIZE], struct adpcmstate *state);
 void uncompressbuf(unsigned char deltas[FRAMESIZE],
                    short outbuf[FRAMESIZE],
                    struct adpcmstate *state);
+void uncompress_frame(unsigned char inbuf[FRAMESIZE], 
+                      short outbuf[FRAMESIZE]);
+unsigned long long framehash(unsigned char frame[FRAMESIZE]);
+static inline void decodeframe(unsigned char deltas[FRAMESIZE],
+                               short outbuf[FRAMESIZE],
+                               struct adpcmstate *state,
+                               struct decoderprofile *profile);
 
 void packbuf(unsigned char outbuf[FRAMESIZE], 
              unsigned char deltas[FRAMESIZE],
@@ -271,9 +311,12 @@ int direction(long *curval, struct adpcmstate *state)
 }
 
 
-// update pointer in step size table, depending on valcase
-void newstep(int valcase, int sign, int delta, struct adpcmstate *state)
+// update pointer in step size table, depending on valcase.
+// Return NEWSTEP_ flags for the limits it was clamped at.
+int newstep(int valcase, int sign, int delta, struct adpcmstate *state)
 {
+  int bounds = 0;
+
   if (valcase > 1)
   { 
     if (valcase == 2 && sign)  // valcase == 2 && sign
@@ -304,9 +347,16 @@ void newstep(int valcase, int sign, int delta, struct adpcmstate *state)
 #endif
 
   if (state->stepsizeptr < state->maxdiffptr)
+  {
     state->stepsizeptr = state->maxdiffptr;
+    bounds |= NEWSTEP_MAXDIFF;
+  }
   if (state->stepsizeptr > state->tableend)
+  {
     state->stepsizeptr = state->tableend;
+    bounds |= NEWSTEP_TABLEEND;
+  }
+  return bounds;
 }
 
 
@@ -326,8 +376,76 @@ long update(long curval, long diff, int sign)
 }
 
 
-// uncompress one frame
+// uncompress one frame, from frame cache if enabled
 void uncompress(unsigned char inbuf[FRAMESIZE], short outbuf[FRAMESIZE])
+{
+  struct framecache_entry *entry;
+  unsigned long long hash;
+  int slot;
+  int probe;
+
+  if (!frame_cache || decoder_profile != NULL)
+  {
+    uncompress_frame(inbuf, outbuf);
+    return;
+  }
+
+  if (framecache == NULL)
+  {
+    framecache = calloc(FRAMECACHE_SIZE, sizeof *framecache);
+    if (framecache == NULL)
+    {
+      uncompress_frame(inbuf, outbuf);
+      return;
+    }
+  }
+
+  hash = framehash(inbuf);
+  slot = hash & (FRAMECACHE_SIZE - 1);
+  for (probe = 0; probe < FRAMECACHE_PROBES; probe++)
+  {
+    entry = &framecache[(slot + probe) & (FRAMECACHE_SIZE - 1)];
+    if (entry->hash == 0)
+      break;
+    if (entry->hash == hash && memcmp(entry->frame, inbuf, FRAMESIZE) == 0)
+    {
+      cache_hits++;
+      memcpy(outbuf, entry->samples, sizeof entry->samples);
+      return;
+    }
+  }
+  if (probe == FRAMECACHE_PROBES)
+    entry = &framecache[slot];
+
+  cache_misses++;
+  uncompress_frame(inbuf, outbuf);
+  entry->hash = hash;
+  memcpy(entry->frame, inbuf, FRAMESIZE);
+  memcpy(entry->samples, outbuf, sizeof entry->samples);
+}
+
+
+// hash of frame for frame cache, never 0
+unsigned long long framehash(unsigned char frame[FRAMESIZE])
+{
+  unsigned long long hash;
+  unsigned long long word;
+  int i;
+
+  hash = 0;
+  for (i = 0; i < FRAMESIZE; i += sizeof word)
+  {
+    memcpy(&word, frame + i, sizeof word);
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 29;
+  }
+  return hash | 1;
+}
+
+
+// uncompress one frame
+void uncompress_frame(unsigned char inbuf[FRAMESIZE], 
+                      short outbuf[FRAMESIZE])
 {
   unsigned char deltas[FRAMESIZE]; // frame of (unpacked) deltas
   struct adpcmstate state;
@@ -354,12 +472,46 @@ void uncompress(unsigned char inbuf[FRAMESIZE], short outbuf[FRAMESIZE])
 void uncompressbuf(unsigned char deltas[FRAMESIZE],
                    short outbuf[FRAMESIZE],
                    struct adpcmstate *state)
+{
+  struct decoderprofile *profile = decoder_profile;
+  int sampleno;
+
+  frames_decoded++;
+  if (profile != NULL)
+  {
+    profile->frames++;
+    profile->constant_frames += constant_frame(deltas, state);
+    profile->tableno[state->tableno]++;
+    decodeframe(deltas, outbuf, state, profile);
+    return;
+  }
+  if (constant_frame(deltas, state))
+  {
+    frames_constant++;
+    for (sampleno = 0; sampleno < FRAMESIZE; sampleno++)
+      outbuf[sampleno] = state->framestartval;
+    return;
+  }
+  decodeframe(deltas, outbuf, state, NULL);
+}
+    
+
+// decoder loop of uncompressbuf(), collecting histograms of decoder
+// state in profile unless it is NULL. Inlined, so that with a NULL
+// profile the counting is left out and the normal loop has no
+// profiling overhead.
+static inline void decodeframe(unsigned char deltas[FRAMESIZE],
+                               short outbuf[FRAMESIZE],
+                               struct adpcmstate *state,
+                               struct decoderprofile *profile)
 {
   long curval;   // current sample value
+  long newval;   // curval before clamping in update()
   long diff;     // scaled delta 
   long delta;    // 0..63, need long for easy multiplication to long
   int sign;      // 0 or 64
   int valcase;   // 0..3
+  int bounds;    // newstep() result
   int sampleno;  // 1..32
 
   curval = outbuf[0] = state->framestartval;
@@ -371,12 +523,110 @@ void uncompressbuf(unsigned char deltas[FRAMESIZE],
     sign = deltas[sampleno-1] & DELTA_SIGNBIT;
     delta = deltas[sampleno-1] & DELTA_MAX;
     diff = scale(delta, *state->stepsizeptr);
+    newval = sign ? curval - diff : curval + diff;
     curval = update(curval, diff, sign);
-    newstep(valcase, sign, delta, state);
+    bounds = newstep(valcase, sign, delta, state);
     outbuf[sampleno] = (short) curval;
+
+    if (profile != NULL)
+    {
+      profile->valcase[valcase]++;
+      profile->deltas[deltas[sampleno-1] & 127]++;
+      profile->update_clamps[0] += (newval > 32767);
+      profile->update_clamps[1] += (newval < -32767);
+      profile->newstep_bounds[0] += (bounds & NEWSTEP_MAXDIFF) != 0;
+      profile->newstep_bounds[1] += (bounds & NEWSTEP_TABLEEND) != 0;
+    }
   }
 }
-    
+
+
+// return 1 if the frame is known to uncompress to framestartval only,
+// as in silence and padding, else 0. That is the case if:
+// - all deltas are 0 (sign bit may be set), and all step sizes the frame
+//   can reach are < 64, so every scaled diff is 0. The step size never
+//   goes above the larger of the stepsize_index and maxdiff_index ones.
+// - twice the smallest step size reachable when direction() is called
+//   covers the dynamics, so curval stays within minval..maxval and
+//   direction() always sets it to (framestartval + curval) / 2, which is
+//   framestartval again. That step size is the smaller of the two.
+// - framestartval is not -32768, which update() would clamp.
+int constant_frame(unsigned char deltas[FRAMESIZE], struct adpcmstate *state)
+{
+  long dynamics;
+  int low, high;
+  int deltano;
+
+  if (state->stepsize_index < state->maxdiff_index)
+  {
+    low = state->stepsize_index;
+    high = state->maxdiff_index;
+  }
+  else
+  {
+    low = state->maxdiff_index;
+    high = state->stepsize_index;
+  }
+  dynamics = (1 << (state->bitdynamics + 1)) - 1;
+  if (state->framestartval == -32768 || state->tablestart[high] >= 64 ||
+      state->tablestart[low] * 2 < dynamics)
+    return 0;
+
+  for (deltano = 0; deltano < FRAMESIZE - 1; deltano++)
+  {
+    if (deltas[deltano] & DELTA_MAX)
+      return 0;
+  }
+  return 1;
+}
+
+
+// check headers of count consecutive frames for values the (disabled)
+// compressor below never produces: stepsize_index below maxdiff_index,
+// or nonzero unused bits between tableno and the first delta. This is a
+// heuristic only: the ES-1 itself is not known to hold to these, and the
+// decoder doesn't depend on them, as every value of every header bit
+// field is a valid table index.
+// No branches in the loop, so it can be vectorized.
+// Return number of unusual frames.
+long checkframes(unsigned char *frames, long count)
+{
+  long bad = 0;
+  long frameno;
+  int stepsize_index;
+  int maxdiff_index;
+
+  for (frameno = 0; frameno < count; frameno++, frames += FRAMESIZE)
+  {
+    stepsize_index = frames[2] >> 2;
+    maxdiff_index = ((frames[2] << 4) & 48) | (frames[3] >> 4);
+    bad += (stepsize_index < maxdiff_index) | ((frames[4] & 0x3e) != 0);
+  }
+  return bad;
+}
+
+
+// coarse envelope of frame from its header only: framestartval plus
+// and minus the dynamics given by bitdynamics, clamped as update() does
+void frame_envelope(unsigned char frame[FRAMESIZE], 
+                    short *minval, short *maxval)
+{
+  long framestartval;
+  long dynamics;
+  long low, high;
+
+  framestartval = (short) ((frame[0] << 8) | frame[1]);
+  dynamics = (1 << ((frame[3] & 15) + 1)) - 1;
+  high = framestartval + dynamics;
+  if (high > 32767)
+    high = 32767;
+  low = framestartval - dynamics;
+  if (low < -32767)
+    low = (framestartval < -32767) ? framestartval : -32767;
+  *minval = (short) low;
+  *maxval = (short) high;
+}
+
 
 #if 0 // test to verify that the data is stored in the right order
 int main()
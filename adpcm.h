@@ -8,3 +8,34 @@
 void uncompress(unsigned char inbuf[FRAMESIZE], short outbuf[FRAMESIZE]);
 void compress(unsigned char outbuf[FRAMESIZE], short inbuf[FRAMESIZE]);
 
+long checkframes(unsigned char *frames, long count);
+void frame_envelope(unsigned char frame[FRAMESIZE], 
+                    short *minval, short *maxval);
+
+// Decoder statistics for the calling thread: frames uncompressed, and
+// how many of those were constant and filled without the ADPCM loop
+extern __thread unsigned long frames_decoded;
+extern __thread unsigned long frames_constant;
+
+// Set frame_cache to remember uncompressed frames, so that repeated
+// identical frames are copied rather than uncompressed again. Each
+// thread has its own cache, and its own hit and miss counts.
+extern int frame_cache;
+extern __thread unsigned long cache_hits;
+extern __thread unsigned long cache_misses;
+
+// Histograms of decoder state, collected by the calling thread while
+// decoder_profile points to one. All frames then go through the full
+// decoder loop, bypassing the frame cache and the constant frame fill.
+struct decoderprofile
+{
+  unsigned long frames;
+  unsigned long constant_frames;     // would have been filled
+  unsigned long tableno[4];
+  unsigned long valcase[4];          // direction() result per sample
+  unsigned long update_clamps[2];    // update() clamped at +32767, -32767
+  unsigned long newstep_bounds[2];   // newstep() hit maxdiffptr, tableend
+  unsigned long deltas[128];         // delta values, sign bit included
+};
+
+extern __thread struct decoderprofile *decoder_profile;
@@ -0,0 +1,169 @@
+// adpcmcheck.c - differential check of Korg ADPCM decoders
+// Runs a decoder and the reference decoder (adpcmref.c) over every
+// combination of frame header fields (tableno, stepsize_index,
+// maxdiff_index, bitdynamics) with a set of delta patterns, and then
+// over a corpus of random frames, stopping at the first frame where
+// the outputs differ.
+
+#include <stdio.h>
+#include <string.h>
+#include "adpcm.h"
+#include "adpcmref.h"
+#include "adpcmcheck.h"
+
+
+// Delta patterns for the exhaustive header check
+enum deltapattern
+{
+  DELTAS_ZERO,        // all deltas 0 (silence)
+  DELTAS_SIGNONLY,    // all deltas 0 with sign bit set
+  DELTAS_MAXPOS,      // all deltas +63
+  DELTAS_MAXNEG,      // all deltas -63
+  DELTAS_ALTERNATE,   // alternating +63/-63
+  DELTAS_RANDOM,      // random deltas
+  DELTAPATTERNS
+};
+
+// Frame start values tried for each header and delta pattern
+short startvals[] = { 0, 1, -1, 32767, -32767, -32768, 12345, -12345 };
+#define STARTVALS (sizeof startvals / sizeof startvals[0])
+
+
+// Prototypes
+int check_frame(decoder_fn decoder, unsigned char frame[FRAMESIZE]);
+void make_frame(unsigned char frame[FRAMESIZE], int startval, 
+                int stepsize_index, int maxdiff_index, int bitdynamics,
+                int tableno, int pattern, unsigned long *seed);
+unsigned long randombits(unsigned long *seed);
+
+
+// Code
+
+// Check decoder against reference decoder, first with all frame header
+// combinations, then with randomframes random frames generated from seed.
+// Report first mismatch. Return 1 if mismatch, else 0.
+int check_decoder(decoder_fn decoder, long randomframes, unsigned long seed)
+{
+  unsigned char frame[FRAMESIZE];
+  int tableno;
+  int stepsize_index;
+  int maxdiff_index;
+  int bitdynamics;
+  int pattern;
+  long frames = 0;
+  long frameno;
+  int i;
+
+  for (tableno = 0; tableno < 4; tableno++)
+    for (stepsize_index = 0; stepsize_index < 64; stepsize_index++)
+      for (maxdiff_index = 0; maxdiff_index < 64; maxdiff_index++)
+        for (bitdynamics = 0; bitdynamics < 16; bitdynamics++)
+          for (pattern = 0; pattern < DELTAPATTERNS; pattern++)
+          {
+            // One start value per frame, cycling through them all
+            make_frame(frame, startvals[frames % STARTVALS],
+                       stepsize_index, maxdiff_index, bitdynamics, 
+                       tableno, pattern, &seed);
+            frames++;
+            if (check_frame(decoder, frame) != 0)
+              return 1;
+          }
+  printf("%ld frames with all header combinations OK\n", frames);
+
+  for (frameno = 0; frameno < randomframes; frameno++)
+  {
+    for (i = 0; i < FRAMESIZE; i++)
+      frame[i] = randombits(&seed);
+    if (check_frame(decoder, frame) != 0)
+      return 1;
+  }
+  printf("%ld random frames OK\n", randomframes);
+
+  return 0;
+}
+
+
+// Decode frame with both decoders and compare. Report any mismatch.
+// Return 1 if mismatch, else 0.
+int check_frame(decoder_fn decoder, unsigned char frame[FRAMESIZE])
+{
+  short expected[FRAMESIZE];
+  short got[FRAMESIZE];
+  int sampleno;
+  int i;
+
+  uncompress_ref(frame, expected);
+  decoder(frame, got);
+  if (memcmp(expected, got, sizeof got) == 0)
+    return 0;
+
+  for (sampleno = 0; expected[sampleno] == got[sampleno]; sampleno++)
+    ;
+  printf("Mismatch at sample %d: expected %d, got %d\n", 
+         sampleno, expected[sampleno], got[sampleno]);
+  printf("Frame:");
+  for (i = 0; i < FRAMESIZE; i++)
+    printf(" %02x", frame[i]);
+  printf("\n");
+  return 1;
+}
+
+
+// Build frame from header fields and delta pattern
+void make_frame(unsigned char frame[FRAMESIZE], int startval, 
+                int stepsize_index, int maxdiff_index, int bitdynamics,
+                int tableno, int pattern, unsigned long *seed)
+{
+  unsigned char deltas[FRAMESIZE];
+  int deltano;
+  int bitpos;
+  int bit;
+
+  for (deltano = 0; deltano < FRAMESIZE - 1; deltano++)
+  {
+    switch (pattern)
+    {
+      case DELTAS_ZERO: deltas[deltano] = 0; break;
+      case DELTAS_SIGNONLY: deltas[deltano] = 64; break;
+      case DELTAS_MAXPOS: deltas[deltano] = 63; break;
+      case DELTAS_MAXNEG: deltas[deltano] = 64 | 63; break;
+      case DELTAS_ALTERNATE: deltas[deltano] = (deltano & 1) ? 64 | 63 : 63;
+                             break;
+      default: deltas[deltano] = randombits(seed) & 127; break;
+    }
+  }
+
+  frame[0] = (startval >> 8) & 255;
+  frame[1] = startval & 255;
+  frame[2] = (stepsize_index << 2) | (maxdiff_index >> 4);
+  frame[3] = ((maxdiff_index & 15) << 4) | bitdynamics;
+  memset(frame + 4, 0, FRAMESIZE - 4);
+  frame[4] = tableno << 6;
+
+  // 31 7-bit deltas packed from the last bit of frame[4] onwards
+  bitpos = 4 * 8 + 7;
+  for (deltano = 0; deltano < FRAMESIZE - 1; deltano++)
+  {
+    for (bit = 6; bit >= 0; bit--, bitpos++)
+    {
+      if (deltas[deltano] & (1 << bit))
+        frame[bitpos >> 3] |= 128 >> (bitpos & 7);
+    }
+  }
+}
+
+
+// xorshift pseudo random number generator, so that the random frames
+// are the same on all platforms for a given seed
+unsigned long randombits(unsigned long *seed)
+{
+  unsigned long x = *seed & 0xffffffffUL;
+
+  if (x == 0)
+    x = 1;
+  x ^= (x << 13) & 0xffffffffUL;
+  x ^= x >> 17;
+  x ^= (x << 5) & 0xffffffffUL;
+  *seed = x;
+  return x;
+}
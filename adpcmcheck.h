@@ -0,0 +1,8 @@
+// adpcmcheck.h - differential check of Korg ADPCM decoders
+// Compares a decoder against the reference decoder in adpcmref.c
+
+// Frame decoder, e.g. uncompress()
+typedef void (*decoder_fn)(unsigned char inbuf[FRAMESIZE], 
+                           short outbuf[FRAMESIZE]);
+
+int check_decoder(decoder_fn decoder, long randomframes, unsigned long seed);
@@ -0,0 +1,4 @@
+// adpcmref.h - reference Korg ADPCM decoder
+// Frozen copy of the original scalar uncompression code
+
+void uncompress_ref(unsigned char inbuf[FRAMESIZE], short outbuf[FRAMESIZE]);
@@ -0,0 +1,136 @@
+// ** arena.c - whole ES-1 file uncompressed into one block of memory
+// ** All samples in one allocation, located through a table
+// **
+// ** The arena is sized up front from the sample headers, and the caller
+// ** provides the memory, so it can be a mapping of a file or of shared
+// ** memory. write_arena() does that with a file, which other processes
+// ** can then map and read without copying.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "adpcm.h"
+#include "es1.h"
+#include "es1c.h"
+#include "arena.h"
+
+
+// Code
+
+// Return # shorts needed for all samples in sampleinfo
+long arena_size(struct sampleinf *sampleinfo, int no_of_samples)
+{
+  long size;
+  int waveno;
+
+  size = 0;
+  for (waveno = 0; waveno < no_of_samples; waveno++)
+    size += sampleinfo[waveno].lensamples;
+  return size;
+}
+
+
+// Uncompress all samples in sampleinfo into arena, one after the other
+// in sampleinfo order, stereo interleaved, and fill in their table
+// entries. arena must hold arena_size() shorts. Return 1 if read error,
+// else 0.
+int decode_arena(FILE *infile, struct sampleinf *sampleinfo, 
+                 int no_of_samples, short *arena, struct arenaentry *table)
+{
+  struct sampleinf *info;
+  struct arenaentry *entry;
+  long offset;
+  int waveno;
+
+  offset = 0;
+  for (waveno = 0; waveno < no_of_samples; waveno++)
+  {
+    info = &sampleinfo[waveno];
+    entry = &table[waveno];
+    entry->sampleno = info->sampleno;
+    entry->channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
+    entry->offset = offset;
+    entry->length = info->lensamples / entry->channels;
+    if (decode_samples(infile, info, arena + offset, arena + offset + 1,
+                       entry->channels) != 0)
+      return 1;
+    offset += info->lensamples;
+  }
+  return 0;
+}
+
+
+// Uncompress all samples of infile into arena file filename, mapped
+// while writing so the samples go straight to the file's pages.
+// Return 1 if read error or bad format, 2 if write error, else 0.
+int write_arena(FILE *infile, char *filename)
+{
+  struct sampleinf sampleinfo[TOTAL_SAMPLES];
+  struct arenaentry table[TOTAL_SAMPLES];
+  unsigned char *map, *p;
+  short *arena;
+  long dataoffset;
+  long filesize;
+  long length;
+  long i;
+  int no_of_samples;
+  int waveno;
+  int status;
+  int fd;
+
+  no_of_samples = read_sampleindex(infile, sampleinfo);
+  if (no_of_samples < 0)
+    return 1;
+
+  length = arena_size(sampleinfo, no_of_samples);
+  dataoffset = (ARENA_HEADER_SIZE + no_of_samples * ARENA_ENTRY_SIZE + 
+                ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  filesize = dataoffset + length * 2;
+
+  fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return 2;
+  if (ftruncate(fd, filesize) < 0)
+  {
+    close(fd);
+    return 2;
+  }
+  map = mmap(NULL, filesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 2;
+
+  arena = (short *) (map + dataoffset);
+  status = decode_arena(infile, sampleinfo, no_of_samples, arena, table);
+
+  if (status == 0)
+  {
+    memcpy(map, ARENA_MAGIC, 4);
+    p = put_16bit_le(ARENA_VERSION, map + 4);
+    p = put_16bit_le(no_of_samples, p);
+    p = put_32bit_le(dataoffset, p);
+    p = put_32bit_le(0, p);
+    for (waveno = 0; waveno < no_of_samples; waveno++)
+    {
+      p = put_16bit_le(table[waveno].sampleno, p);
+      p = put_16bit_le(table[waveno].channels, p);
+      p = put_32bit_le(table[waveno].offset, p);
+      p = put_32bit_le(table[waveno].length, p);
+      p = put_32bit_le(0, p);
+    }
+
+    // Samples to little endian, in place (no-op on little endian CPUs)
+    for (i = 0; i < length; i++)
+      put_16bit_le(arena[i], (unsigned char *) &arena[i]);
+  }
+
+  if (munmap(map, filesize) < 0 && status == 0)
+    status = 2;
+  if (status != 0)
+    remove(filename);
+  return status;
+}
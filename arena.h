@@ -0,0 +1,27 @@
+// ** arena.h - whole ES-1 file uncompressed into one block of memory
+// ** All samples in one allocation, located through a table
+
+// Location of one sample in the arena, in shorts from its start
+struct arenaentry
+{
+  int sampleno;
+  int channels;
+  long offset;                  // first sample, stereo interleaved
+  long length;                  // samples per channel
+};
+
+// Arena file layout, all values little endian:
+// header: "ES1A", version (16), # samples (16), data offset (32), 0 (32)
+// one table entry per sample: sampleno (16), channels (16), offset (32),
+//   length (32), 0 (32)
+// data: the arena, 16-bit samples, starting at data offset (page aligned)
+#define ARENA_MAGIC "ES1A"
+#define ARENA_VERSION (1)
+#define ARENA_HEADER_SIZE (16)
+#define ARENA_ENTRY_SIZE (16)
+#define ARENA_ALIGN (4096L)
+
+long arena_size(struct sampleinf *sampleinfo, int no_of_samples);
+int decode_arena(FILE *infile, struct sampleinf *sampleinfo, 
+                 int no_of_samples, short *arena, struct arenaentry *table);
+int write_arena(FILE *infile, char *filename);
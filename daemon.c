@@ -0,0 +1,344 @@
+// ** daemon.c - es12wav conversion daemon
+// ** Serve uncompressed samples over a Unix domain socket
+// **
+// ** Protocol: the client sends one request per line,
+// **   <es1file> <sample> <format>\n
+// ** where <sample> is a sample name as used for output files ("07" for
+// ** mono sample 7, "12s" for stereo sample 12) and <format> is "wav"
+// ** (complete .wav file) or "pcm" (16-bit little endian samples, stereo
+// ** interleaved). <es1file> may be "-" if an open file descriptor is
+// ** passed (SCM_RIGHTS) with the request. The reply is either
+// **   OK <length>\n<length bytes of data>
+// ** or
+// **   ERR <message>\n
+// ** A connection may be used for any number of requests.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "adpcm.h"
+#include "es1.h"
+#include "daemon.h"
+
+
+// Max length of request line
+#define REQUEST_MAX (PATH_MAX + 32)
+
+// Client connection, with buffered request data and passed descriptor
+struct connection
+{
+  int fd;
+  int passedfd;          // descriptor passed with request, or -1
+  int len;               // bytes in buf
+  char buf[REQUEST_MAX];
+};
+
+
+// Prototypes
+void *worker(void *arg);
+void serve_connection(int fd);
+int read_request(struct connection *conn, char *line);
+void handle_request(struct connection *conn, char *line);
+int send_all(int fd, void *buf, long len);
+int send_error(int fd, char *message);
+
+
+// Code
+
+// Listen on socketname, serving requests with a pool of threads.
+// Only returns if there is an error setting up the socket.
+int run_daemon(char *socketname, int threads)
+{
+  struct sockaddr_un addr;
+  pthread_t thread;
+  static int listenfd;
+  int i;
+
+  if (strlen(socketname) >= sizeof addr.sun_path)
+  {
+    fprintf(stderr, "Socket name too long\n");
+    return 1;
+  }
+
+  listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenfd < 0)
+  {
+    perror("Error creating socket");
+    return 1;
+  }
+
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socketname);
+  unlink(socketname);
+  if (bind(listenfd, (struct sockaddr *) &addr, sizeof addr) < 0 ||
+      listen(listenfd, SOMAXCONN) < 0)
+  {
+    perror("Error listening on socket");
+    close(listenfd);
+    return 1;
+  }
+
+  printf("Listening on %s with %d threads\n", socketname, threads);
+  fflush(stdout);
+
+  // All threads accept connections on the same socket; the last
+  // one is this thread.
+  for (i = 1; i < threads; i++)
+  {
+    if (pthread_create(&thread, NULL, worker, &listenfd) != 0)
+    {
+      perror("Error creating thread");
+      return 1;
+    }
+    pthread_detach(thread);
+  }
+  worker(&listenfd);
+
+  return 0;
+}
+
+
+// Worker thread: accept connections and serve them, forever
+void *worker(void *arg)
+{
+  int listenfd = *(int *) arg;
+  int fd;
+
+  for (;;)
+  {
+    fd = accept(listenfd, NULL, NULL);
+    if (fd < 0)
+    {
+      if (errno != EINTR && errno != ECONNABORTED)
+        perror("Error accepting connection");
+      continue;
+    }
+    serve_connection(fd);
+    close(fd);
+  }
+
+  return NULL;
+}
+
+
+// Serve requests on connection until client closes it
+void serve_connection(int fd)
+{
+  struct connection conn;
+  char line[REQUEST_MAX];
+
+  conn.fd = fd;
+  conn.passedfd = -1;
+  conn.len = 0;
+
+  while (read_request(&conn, line) == 0)
+    handle_request(&conn, line);
+
+  if (conn.passedfd >= 0)
+    close(conn.passedfd);
+}
+
+
+// Read next request line (without newline) from connection into line.
+// Any file descriptor passed with it ends up in conn->passedfd.
+// Return 1 if connection closed or error, else 0.
+int read_request(struct connection *conn, char *line)
+{
+  char control[CMSG_SPACE(sizeof (int))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char *newline;
+  ssize_t got;
+  int linelen;
+
+  while ((newline = memchr(conn->buf, '\n', conn->len)) == NULL)
+  {
+    if (conn->len == sizeof conn->buf)
+      return 1;            // line too long
+
+    iov.iov_base = conn->buf + conn->len;
+    iov.iov_len = sizeof conn->buf - conn->len;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    got = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (got <= 0)
+      return 1;
+    conn->len += got;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      {
+        if (conn->passedfd >= 0)
+          close(conn->passedfd);
+        memcpy(&conn->passedfd, CMSG_DATA(cmsg), sizeof (int));
+      }
+    }
+  }
+
+  linelen = newline - conn->buf;
+  memcpy(line, conn->buf, linelen);
+  line[linelen] = '\0';
+  conn->len -= linelen + 1;
+  memmove(conn->buf, newline + 1, conn->len);
+  return 0;
+}
+
+
+// Uncompress sample given in request line and send it to client
+void handle_request(struct connection *conn, char *line)
+{
+  struct sampleinf sampleinfo[TOTAL_SAMPLES];
+  struct sampleinf *info;
+  unsigned char *buf, *p;
+  char filename[REQUEST_MAX];
+  char samplename[16];
+  char format[16];
+  char reply[32];
+  FILE *infile;
+  long samplebytes;
+  long channels;
+  int no_of_samples;
+  int sampleno;
+  int wav;
+  int waveno;
+  int status;
+
+  if (sscanf(line, "%s %15s %15s", filename, samplename, format) != 3 ||
+      (strcmp(format, "wav") != 0 && strcmp(format, "pcm") != 0))
+  {
+    send_error(conn->fd, "bad request");
+    return;
+  }
+  wav = (strcmp(format, "wav") == 0);
+
+  sampleno = parse_sample_name(samplename);
+  if (sampleno < 0)
+  {
+    send_error(conn->fd, "bad sample name");
+    return;
+  }
+
+  if (strcmp(filename, "-") == 0)
+  {
+    if (conn->passedfd < 0)
+    {
+      send_error(conn->fd, "no file descriptor passed");
+      return;
+    }
+    infile = fdopen(conn->passedfd, "rb");
+    conn->passedfd = -1;   // closed by fclose() below
+  }
+  else
+    infile = fopen(filename, "rb");
+  if (infile == NULL)
+  {
+    send_error(conn->fd, "can't open file");
+    return;
+  }
+
+  if (check_signature(infile) != 0)
+  {
+    fclose(infile);
+    send_error(conn->fd, "not an ES1 file");
+    return;
+  }
+
+  // Only the requested sample is checked, so others can still be served
+  // from an image with some bad sample headers
+  no_of_samples = read_rawsampleheaders(infile, sampleinfo);
+  if (no_of_samples < 0)
+  {
+    fclose(infile);
+    send_error(conn->fd, "can't read sample headers");
+    return;
+  }
+  info = NULL;
+  for (waveno = 0; waveno < no_of_samples; waveno++)
+  {
+    if (sampleinfo[waveno].sampleno == sampleno)
+      info = &sampleinfo[waveno];
+  }
+  if (info == NULL)
+  {
+    fclose(infile);
+    send_error(conn->fd, "no such sample");
+    return;
+  }
+  if (check_sampleinfo(info) != 0)
+  {
+    fclose(infile);
+    send_error(conn->fd, "bad sample header");
+    return;
+  }
+
+  channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
+  samplebytes = info->lensamples * 2;
+  buf = malloc(WAVHEADER_SIZE + samplebytes);
+  if (buf == NULL)
+  {
+    fclose(infile);
+    send_error(conn->fd, "out of memory");
+    return;
+  }
+
+  p = wav ? put_wav_header(channels, samplebytes, buf) : buf;
+  status = write_samples(infile, p, info);
+  fclose(infile);
+
+  if (status != 0)
+    send_error(conn->fd, "error reading file");
+  else
+  {
+    sprintf(reply, "OK %ld\n", (long) (p - buf) + samplebytes);
+    if (send_all(conn->fd, reply, strlen(reply)) == 0)
+      send_all(conn->fd, buf, (p - buf) + samplebytes);
+  }
+
+  free(buf);
+}
+
+
+// Send len bytes from buf. Return 1 if failure, else 0.
+int send_all(int fd, void *buf, long len)
+{
+  ssize_t sent;
+
+  while (len > 0)
+  {
+    sent = send(fd, buf, len, MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    buf = (char *) buf + sent;
+    len -= sent;
+  }
+  return 0;
+}
+
+
+// Send error reply. Return 1 if failure, else 0.
+int send_error(int fd, char *message)
+{
+  char reply[80];
+
+  snprintf(reply, sizeof reply, "ERR %s\n", message);
+  return send_all(fd, reply, strlen(reply));
+}
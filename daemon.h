@@ -0,0 +1,4 @@
+// ** daemon.h - es12wav conversion daemon
+// ** Serve uncompressed samples over a Unix domain socket
+
+int run_daemon(char *socketname, int threads);
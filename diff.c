@@ -0,0 +1,273 @@
+// ** diff.c - compare two ES-1 files
+// ** Report added, removed, moved, copied and modified samples, at frame
+// ** level
+// **
+// ** Samples are compared by their compressed frames, without
+// ** uncompressing anything. A sample is "moved" if the same data is
+// ** found under another sample number, or at another address in the
+// ** file, and "copied" if it came from another sample number that still
+// ** holds it unchanged. It is "modified" if its data differs, in which
+// ** case the changed frame ranges are listed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "adpcm.h"
+#include "es1.h"
+#include "diff.h"
+
+
+// Sample data of one file, indexed by sampleno
+struct sampledata
+{
+  struct sampleinf *info;       // NULL if sample not in file
+  unsigned char *frames;        // left (or mono) frames, then right frames
+  long frames_per_channel;
+  int channels;
+  unsigned long long hash;      // hash of all frames and length
+};
+
+
+// Prototypes
+int load_samples(FILE *infile, struct sampleinf *sampleinfo,
+                 struct sampledata *data);
+void free_samples(struct sampledata *data);
+void report_frames(struct sampledata *olddata, struct sampledata *newdata);
+int same_data(struct sampledata *a, struct sampledata *b);
+
+
+// Code
+
+// Compare oldfile with newfile and print the differences. The sample
+// info of samples added or modified in newfile is copied to changed.
+// Return # of samples in changed, or -1 if read error or bad format.
+int diff_files(FILE *oldfile, FILE *newfile, struct sampleinf *changed)
+{
+  struct sampleinf oldinfo[TOTAL_SAMPLES];
+  struct sampleinf newinfo[TOTAL_SAMPLES];
+  struct sampledata olddata[TOTAL_SAMPLES];
+  struct sampledata newdata[TOTAL_SAMPLES];
+  struct sampledata *o, *n;
+  char name[16];
+  char othername[16];
+  int changes;
+  int no_changed;
+  int sampleno;
+  int other;
+  int status;
+
+  status = load_samples(oldfile, oldinfo, olddata);
+  if (status == 0)
+    status = load_samples(newfile, newinfo, newdata);
+  else
+    memset(newdata, 0, sizeof newdata);
+  if (status != 0)
+  {
+    free_samples(olddata);
+    free_samples(newdata);
+    return -1;
+  }
+
+  changes = 0;
+  no_changed = 0;
+  for (sampleno = 0; sampleno < TOTAL_SAMPLES; sampleno++)
+  {
+    o = &olddata[sampleno];
+    n = &newdata[sampleno];
+    sample_name(name, sampleno);
+
+    if (o->info == NULL && n->info == NULL)
+      continue;
+
+    if (n->info == NULL)
+    {
+      // Not removed if moved to another sample, reported there
+      for (other = 0; other < TOTAL_SAMPLES; other++)
+      {
+        if (newdata[other].info != NULL && same_data(o, &newdata[other]))
+          break;
+      }
+      if (other == TOTAL_SAMPLES)
+      {
+        printf("removed  %s\n", name);
+        changes++;
+      }
+      continue;
+    }
+
+    if (o->info != NULL && same_data(o, n))
+    {
+      if (o->info->startaddr != n->info->startaddr)
+      {
+        printf("moved    %s (address %ld -> %ld)\n", name,
+               o->info->startaddr, n->info->startaddr);
+        changes++;
+      }
+      continue;
+    }
+
+    // New or changed data here; see if it came from another sample
+    for (other = 0; other < TOTAL_SAMPLES; other++)
+    {
+      if (other != sampleno && olddata[other].info != NULL &&
+          same_data(&olddata[other], n))
+        break;
+    }
+    if (other < TOTAL_SAMPLES)
+    {
+      sample_name(othername, other);
+      if (newdata[other].info != NULL &&
+          same_data(&olddata[other], &newdata[other]))
+        printf("copied   %s -> %s\n", othername, name);
+      else
+        printf("moved    %s -> %s\n", othername, name);
+      changes++;
+      continue;
+    }
+
+    changes++;
+    if (o->info == NULL)
+      printf("added    %s (%ld samples)\n", name,
+             n->info->lensamples / n->channels);
+    else
+    {
+      printf("modified %s", name);
+      if (o->info->lensamples != n->info->lensamples)
+        printf(" (length %ld -> %ld)", o->info->lensamples / o->channels,
+               n->info->lensamples / n->channels);
+      report_frames(o, n);
+    }
+
+    changed[no_changed++] = *n->info;
+  }
+
+  printf("%d change%s\n", changes, changes == 1 ? "" : "s");
+
+  free_samples(olddata);
+  free_samples(newdata);
+  return no_changed;
+}
+
+
+// Read sample headers and compressed frames of all samples in infile.
+// Return 1 if read error or bad format, else 0.
+int load_samples(FILE *infile, struct sampleinf *sampleinfo,
+                 struct sampledata *data)
+{
+  struct sampledata *d;
+  struct sampleinf *info;
+  unsigned char lenbuf[4];
+  long bytes;
+  int no_of_samples;
+  int waveno;
+  int channel;
+
+  memset(data, 0, TOTAL_SAMPLES * sizeof *data);
+  if (check_signature(infile) != 0)
+    return 1;
+  no_of_samples = read_sampleheaders(infile, sampleinfo);
+  if (no_of_samples < 0)
+    return 1;
+
+  for (waveno = 0; waveno < no_of_samples; waveno++)
+  {
+    info = &sampleinfo[waveno];
+    d = &data[info->sampleno];
+    d->info = info;
+    d->channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
+    d->frames_per_channel = sample_frames(info);
+    bytes = d->frames_per_channel * FRAMESIZE;
+    d->frames = malloc(d->channels * bytes + 1);
+    if (d->frames == NULL)
+      return 1;
+
+    // Right channel is lenbytes after left, like in write_samples()
+    for (channel = 0; channel < d->channels; channel++)
+    {
+      if (fseek(infile, info->startaddr + channel * info->lenbytes,
+                SEEK_SET) != 0 ||
+          fread(d->frames + channel * bytes, 1, bytes, infile) != bytes)
+      {
+        fprintf(stderr, "Can't read sample %d\n", info->sampleno);
+        return 1;
+      }
+    }
+
+    put_32bit_le(info->lensamples, lenbuf);
+    d->hash = fnv1a(FNV1A_INIT, lenbuf, sizeof lenbuf);
+    d->hash = fnv1a(d->hash, d->frames, d->channels * bytes);
+  }
+
+  return 0;
+}
+
+
+void free_samples(struct sampledata *data)
+{
+  int sampleno;
+
+  for (sampleno = 0; sampleno < TOTAL_SAMPLES; sampleno++)
+    free(data[sampleno].frames);
+}
+
+
+// Return 1 if a and b have the same channels, length and frames
+int same_data(struct sampledata *a, struct sampledata *b)
+{
+  return a->hash == b->hash && a->channels == b->channels &&
+         a->info->lensamples == b->info->lensamples &&
+         memcmp(a->frames, b->frames,
+                a->channels * a->frames_per_channel * FRAMESIZE) == 0;
+}
+
+
+// Print ranges of frames that differ between old and new sample, a frame
+// differing if it does in either channel. Frames only in the longer of
+// the two count as changed.
+void report_frames(struct sampledata *olddata, struct sampledata *newdata)
+{
+  long frames;
+  long common;
+  long frameno;
+  long first;
+  long oldbytes, newbytes;
+  int changed;
+  int channel;
+  int ranges;
+
+  frames = newdata->frames_per_channel;
+  if (olddata->frames_per_channel > frames)
+    frames = olddata->frames_per_channel;
+  common = newdata->frames_per_channel;
+  if (olddata->frames_per_channel < common)
+    common = olddata->frames_per_channel;
+  oldbytes = olddata->frames_per_channel * FRAMESIZE;
+  newbytes = newdata->frames_per_channel * FRAMESIZE;
+
+  printf(": frames");
+  ranges = 0;
+  first = -1;
+  for (frameno = 0; frameno <= frames; frameno++)
+  {
+    changed = (frameno < frames);
+    if (frameno < common && olddata->channels == newdata->channels)
+    {
+      changed = 0;
+      for (channel = 0; channel < newdata->channels; channel++)
+        changed |= memcmp(olddata->frames + channel * oldbytes +
+                          frameno * FRAMESIZE,
+                          newdata->frames + channel * newbytes +
+                          frameno * FRAMESIZE, FRAMESIZE) != 0;
+    }
+    if (changed && first < 0)
+      first = frameno;
+    else if (!changed && first >= 0)
+    {
+      printf("%s %ld", ranges++ ? "," : "", first);
+      if (frameno - 1 > first)
+        printf("-%ld", frameno - 1);
+      first = -1;
+    }
+  }
+  printf(" of %ld changed\n", frames);
+}
@@ -0,0 +1,5 @@
+// ** diff.h - compare two ES-1 files
+// ** Report added, removed, moved, copied and modified samples, at frame
+// ** level
+
+int diff_files(FILE *oldfile, FILE *newfile, struct sampleinf *changed);
@@ -0,0 +1,494 @@
+// ** es1.c - ES-1 file format: sample headers and sample data
+// ** Reverse engineered version of Korg's ES2WAV.EXE program 
+// ** RW 040314
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "adpcm.h"
+#include "es1.h"
+
+
+#define DEBUG (0)
+
+// Frames read at a time by sample_envelope()
+#define ENVELOPE_FRAMES (256)
+
+// Layout of the mono and the stereo sample headers in the header table,
+// which has count headers of each, one after the other
+struct headerlayout
+{
+  int first;                    // sampleno of first header
+  int count;
+  int size;
+  int st, end, staddr, endaddr, status;   // field offsets in header
+  int channels;                 // end - st + 1 is samples per channel
+  int lenbytes_adjust;          // endaddr is last byte (1) or end (0)
+};
+
+static const struct headerlayout headerlayouts[] =
+{
+  {
+    0, MONO_SAMPLES, MONO_SAMPLEHEAD_SIZE,
+    MSMPLHEAD_ST_H, MSMPLHEAD_END_H, MSMPLHEAD_STADDR_H, MSMPLHEAD_ENDADDR_H,
+    MSMPLHEAD_STATUS, 1, 1
+  },
+  {
+    MONO_SAMPLES, STEREO_SAMPLES, STEREO_SAMPLEHEAD_SIZE,
+    SSMPLHEAD_ST_H, SSMPLHEAD_END_H, SSMPLHEAD_STADDR_H, SSMPLHEAD_ENDADDR_H,
+    SSMPLHEAD_STATUS, 2, 0
+  }
+};
+#define HEADERLAYOUTS ((int) (sizeof headerlayouts / sizeof headerlayouts[0]))
+
+
+// Prototypes
+void extract_fields(const unsigned char *fields, int size, int count,
+                    long *values);
+void extract_status(const unsigned char *status, int size, int count,
+                    unsigned char *values);
+
+
+// Code
+
+// Check that infile has ES-1 file headers, and leave it positioned
+// at the sample headers. Return 1 if not an ES-1 file, else 0.
+int check_signature(FILE *infile)
+{
+  char buf[20];
+
+  if (fread(buf, 1, 20, infile) != 20 ||
+      strncmp(buf, "KORG", 4) != 0 || buf[6] != 87)
+  {
+    fprintf(stderr, "Not an ES1 file! (1)\n");
+    return 1;
+  }
+
+  fseek(infile, HEADERPOS, SEEK_SET);
+  if (fread(buf, 1, 20, infile) != 20 ||
+      strncmp(buf, "KORG", 4) != 0 || buf[6] != 87)
+  {
+    fprintf(stderr, "Not an ES1 file! (2)\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+
+// Read the header table of all samples, at the current position of
+// infile, in one go and extract its fields into slots. Samples beyond a
+// short read are left empty. Return 1 if read error or short read,
+// else 0.
+int read_slottable(FILE *infile, struct slottable *slots)
+{
+  unsigned char table[SAMPLEHEADS_END - SAMPLEHEADS_POS];
+  const struct headerlayout *layout;
+  const unsigned char *headers;
+  size_t len;
+  int layoutno;
+
+  len = fread(table, 1, sizeof table, infile);
+  memset(table + len, 255, sizeof table - len);
+
+  headers = table;
+  for (layoutno = 0; layoutno < HEADERLAYOUTS; layoutno++)
+  {
+    layout = &headerlayouts[layoutno];
+    extract_fields(headers + layout->st, layout->size, layout->count,
+                   slots->st + layout->first);
+    extract_fields(headers + layout->end, layout->size, layout->count,
+                   slots->end + layout->first);
+    extract_fields(headers + layout->staddr, layout->size, layout->count,
+                   slots->staddr + layout->first);
+    extract_fields(headers + layout->endaddr, layout->size, layout->count,
+                   slots->endaddr + layout->first);
+    extract_status(headers + layout->status, layout->size, layout->count,
+                   slots->status + layout->first);
+    headers += layout->count * layout->size;
+  }
+
+  return len != sizeof table || ferror(infile) != 0;
+}
+
+
+// Extract the 24 bit big endian field at fields, fields + size, ... of
+// count headers into values. No branches, so it can be vectorized.
+void extract_fields(const unsigned char *fields, int size, int count,
+                    long *values)
+{
+  int i;
+
+  for (i = 0; i < count; i++, fields += size)
+    values[i] = ((long) fields[0] << 16) | (fields[1] << 8) | fields[2];
+}
+
+
+// Extract the status byte at status, status + size, ... of count
+// headers into values
+void extract_status(const unsigned char *status, int size, int count,
+                    unsigned char *values)
+{
+  int i;
+
+  for (i = 0; i < count; i++, status += size)
+    values[i] = *status;
+}
+
+
+// Read sample headers at the current position of infile into sampleinfo,
+// one entry per sample present, and check them with check_sampleinfo().
+// Return # of samples, or -1 if read error or bad sample header.
+int read_sampleheaders(FILE *infile, struct sampleinf *sampleinfo)
+{
+  char name[16];
+  int no_of_samples;
+  int waveno;
+
+  no_of_samples = read_rawsampleheaders(infile, sampleinfo);
+  for (waveno = 0; waveno < no_of_samples; waveno++)
+  {
+    if (check_sampleinfo(&sampleinfo[waveno]) != 0)
+    {
+      sample_name(name, sampleinfo[waveno].sampleno);
+      fprintf(stderr, "Bad sample header of sample %s\n", name);
+      return -1;
+    }
+  }
+  return no_of_samples;
+}
+
+
+// Read sample headers like read_sampleheaders(), but without checking
+// them. Return # of samples, or -1 if read error.
+int read_rawsampleheaders(FILE *infile, struct sampleinf *sampleinfo)
+{
+  struct slottable slots;
+  const struct headerlayout *layout;
+  struct sampleinf *info;
+  int waveno = 0;
+  int sampleno;
+  int layoutno;
+
+  if (read_slottable(infile, &slots) != 0)
+    return -1;
+
+  for (layoutno = 0; layoutno < HEADERLAYOUTS; layoutno++)
+  {
+    layout = &headerlayouts[layoutno];
+    for (sampleno = layout->first; 
+         sampleno < layout->first + layout->count; sampleno++)
+    {
+      if (slots.status[sampleno] == 255)
+        continue;
+      info = &sampleinfo[waveno++];
+      info->sampleno = sampleno;
+      info->status = slots.status[sampleno];
+      info->lensamples = (slots.end[sampleno] - slots.st[sampleno] + 1) *
+                         layout->channels;
+      info->lenbytes = slots.endaddr[sampleno] - slots.staddr[sampleno] +
+                       layout->lenbytes_adjust;
+      info->startaddr = slots.staddr[sampleno] - ADDR_OFFSET;
+#if DEBUG
+      printf("Sample %d, status %d, lensamples %ld, lenbytes %ld, addr %ld\n", 
+             info->sampleno, info->status, 
+             info->lensamples, info->lenbytes, info->startaddr);
+#endif
+    }
+  }
+
+  return waveno;
+}
+
+// Uncompress whole sample to outbuf as 16-bit little endian samples,
+// stereo interleaved. Return 1 if read error, else 0.
+int write_samples(FILE *infile, unsigned char *outbuf, struct sampleinf *info)
+{
+  short *samples;
+  long sampleno;
+  int status;
+
+  // Uncompress in place as shorts, stereo interleaved, then convert
+  // each to little endian
+  samples = (short *) outbuf;
+  status = decode_samples(infile, info, samples, samples + 1, 
+                          (info->sampleno >= MONO_SAMPLES) ? 2 : 1);
+  if (status != 0)
+    return status;
+
+  for (sampleno = 0; sampleno < info->lensamples; sampleno++)
+    put_16bit_le(samples[sampleno], outbuf + sampleno * 2);
+
+  return 0;
+}
+
+
+// Uncompress whole sample to left (mono/left channel) and right (right
+// channel, unused for mono), with stride shorts between consecutive
+// samples of each channel. Return 1 if read error, else 0.
+int decode_samples(FILE *infile, struct sampleinf *info, 
+                   short *left, short *right, long stride)
+{
+  long channels;
+
+  channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
+  return decode_range(infile, info, 0, info->lensamples / channels,
+                      left, right, stride);
+}
+
+
+// Uncompress samples start..end-1 (per channel) of sample, like
+// decode_samples(). As each frame starts from scratch, only the frames
+// covering the range are read. Return 1 if bad range or read error,
+// else 0.
+int decode_range(FILE *infile, struct sampleinf *info, long start, long end,
+                 short *left, short *right, long stride)
+{
+  long frameno;
+  long lastframe;
+  long framestart;
+  int first, last;
+  int sampleno;
+  int stereo;
+  unsigned char inbuf[FRAMESIZE];  // input (compressed) frame mono/left
+  unsigned char inbufa[FRAMESIZE]; // input (compressed) frame right
+  short outbuf[FRAMESIZE];         // output samples mono/left
+  short outbufa[FRAMESIZE];        // output samples right
+
+
+  stereo = (info->sampleno >= MONO_SAMPLES);
+  if (start < 0 || end > info->lensamples / (stereo ? 2 : 1) || start > end)
+    return 1;
+  if (start == end)
+    return 0;
+
+  frameno = start / FRAMESIZE;
+  lastframe = (end - 1) / FRAMESIZE;
+  if (fseek(infile, info->startaddr + frameno * FRAMESIZE, SEEK_SET) != 0)
+    return 1;
+
+  // Do this one frame at a time. Last frame will be complete,
+  // but we may use only part of it, as well as of the first one
+  for (; frameno <= lastframe; frameno++)
+  {
+    // ** Read data and uncompress **
+    framestart = frameno * FRAMESIZE;
+    if (fread(inbuf, 1, sizeof inbuf, infile) != FRAMESIZE)
+      return 1;
+    uncompress(inbuf, outbuf);
+    if (stereo)
+    {
+      if (fseek(infile, info->startaddr + info->lenbytes + framestart,
+                SEEK_SET) != 0 ||
+          fread(inbufa, 1, sizeof inbufa, infile) != FRAMESIZE)
+        return 1;
+      uncompress(inbufa, outbufa);
+      if (fseek(infile, info->startaddr + framestart + FRAMESIZE, 
+                SEEK_SET) != 0)
+        return 1;
+    }
+    // ** Write to output **
+    first = (start > framestart) ? start - framestart : 0;
+    last = (end < framestart + FRAMESIZE) ? end - framestart : FRAMESIZE;
+    for (sampleno = first; sampleno < last; sampleno++)
+    {
+      *left = outbuf[sampleno];
+      left += stride;
+      if (stereo) 
+      {
+        *right = outbufa[sampleno];
+        right += stride;
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+// Set namebuf to name of sample: "NN" for mono, "NNs" for stereo
+void sample_name(char *namebuf, int sampleno)
+{
+  if (sampleno < MONO_SAMPLES)
+    sprintf(namebuf, "%02d", sampleno);
+  else
+    sprintf(namebuf, "%02ds", sampleno - MONO_SAMPLES);
+}
+
+
+// Convert sample name ("07", "12s") to sampleno. Return -1 if invalid.
+int parse_sample_name(char *name)
+{
+  char *end;
+  long sampleno;
+
+  sampleno = strtol(name, &end, 10);
+  if (end == name)
+    return -1;
+  if (*end == 's' && end[1] == '\0' &&
+      sampleno >= 0 && sampleno < STEREO_SAMPLES)
+    return sampleno + MONO_SAMPLES;
+  if (*end == '\0' && sampleno >= 0 && sampleno < MONO_SAMPLES)
+    return sampleno;
+  return -1;
+}
+
+
+// Return # frames of each channel of sample
+long sample_frames(struct sampleinf *info)
+{
+  long channels;
+
+  channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
+  return (info->lensamples / channels + FRAMESIZE - 1) / FRAMESIZE;
+}
+
+
+// Return 1 if sample header fields are out of range, so that buffers
+// can't be sized from them: no samples, negative address or length, or
+// fewer bytes than the frames for the samples take. Else return 0.
+int check_sampleinfo(struct sampleinf *info)
+{
+  return info->lensamples <= 0 || info->lenbytes < 0 || 
+         info->startaddr < 0 ||
+         sample_frames(info) * FRAMESIZE > info->lenbytes;
+}
+
+
+// Return # bytes of sample data read by decode_range() for the whole
+// sample: the frames of the last channel, and everything before them
+long sample_databytes(struct sampleinf *info)
+{
+  long channels;
+
+  channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
+  return (channels - 1) * info->lenbytes + sample_frames(info) * FRAMESIZE;
+}
+
+
+// Get coarse envelope of sample, one min/max pair per frame, from the
+// frame headers only (see frame_envelope()). minval and maxval get all
+// frames of the left (or mono) channel, then of the right channel.
+// Return 1 if read error, else 0.
+int sample_envelope(FILE *infile, struct sampleinf *info,
+                    short *minval, short *maxval)
+{
+  unsigned char frames[ENVELOPE_FRAMES * FRAMESIZE];
+  long channels;
+  long frames_per_channel;
+  long frameno;
+  long count;
+  long i;
+  int channel;
+
+  channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
+  frames_per_channel = sample_frames(info);
+
+  for (channel = 0; channel < channels; channel++)
+  {
+    if (fseek(infile, info->startaddr + channel * info->lenbytes, 
+              SEEK_SET) != 0)
+      return 1;
+    for (frameno = 0; frameno < frames_per_channel; frameno += count)
+    {
+      count = frames_per_channel - frameno;
+      if (count > ENVELOPE_FRAMES)
+        count = ENVELOPE_FRAMES;
+      if ((long) fread(frames, FRAMESIZE, count, infile) != count)
+        return 1;
+      for (i = 0; i < count; i++)
+        frame_envelope(frames + i * FRAMESIZE, minval++, maxval++);
+    }
+  }
+  return 0;
+}
+
+
+// Put complete .wav header for sample data of samplebytes bytes into
+// buffer (WAVHEADER_SIZE bytes). Return pointer past header.
+unsigned char *put_wav_header(long channels, long samplebytes,
+                              unsigned char *buf)
+{
+  long totallength;
+
+  totallength = samplebytes + 36; // sizeof fmtheader
+
+  // .WAV header
+  memcpy(buf, "RIFF", 4); buf += 4;
+  buf = put_32bit_le(totallength, buf);
+  memcpy(buf, "WAVE", 4); buf += 4;
+
+  // fmt chunk
+  buf = put_fmt_chunk(channels, buf);
+
+  // data chunk
+  memcpy(buf, "data", 4); buf += 4;
+  buf = put_32bit_le(samplebytes, buf);
+  return buf;
+}
+
+
+// Put .wav fmt chunk into buffer. Return pointer past chunk.
+unsigned char *put_fmt_chunk(long channels, unsigned char *buf)
+{
+  long fmt_headerlen;
+  short tag_sh;
+  short channels_sh;
+  long sample_rate;
+  long data_rate;
+  short blk_algn_sh;
+  short bits_per_sample_sh;
+
+  tag_sh = 1;
+  channels_sh = (short) channels;
+  
+  sample_rate = ES1_SAMPLERATE;
+  data_rate = sample_rate * channels * 2;
+  blk_algn_sh = channels_sh * 2;
+  bits_per_sample_sh = ES1_SAMPLEBITS;
+
+  fmt_headerlen = 16;
+  memcpy(buf, "fmt ", 4); buf += 4;
+  buf = put_32bit_le(fmt_headerlen, buf);
+
+  buf = put_16bit_le(tag_sh, buf);
+  buf = put_16bit_le(channels_sh, buf);
+  buf = put_32bit_le(sample_rate, buf);
+  buf = put_32bit_le(data_rate, buf);
+  buf = put_16bit_le(blk_algn_sh, buf);
+  buf = put_16bit_le(bits_per_sample_sh, buf);
+  return buf;
+}
+
+
+// Put 32-bit little endian into buffer. Return pointer past value.
+unsigned char *put_32bit_le(long value, unsigned char *buf)
+{
+  buf[0] = value & 255;
+  buf[1] = (value >> 8) & 255;
+  buf[2] = (value >> 16) & 255;
+  buf[3] = (value >> 24) & 255;
+  return buf + 4;
+}
+
+
+// Put 16-bit little endian into buffer. Return pointer past value.
+unsigned char *put_16bit_le(short value, unsigned char *buf)
+{
+  buf[0] = value & 255;
+  buf[1] = (value >> 8) & 255;
+  return buf + 2;
+}
+
+
+// Add len bytes at data to FNV-1a 64 bit hash, starting from FNV1A_INIT.
+// Return new hash.
+unsigned long long fnv1a(unsigned long long hash, const unsigned char *data,
+                         long len)
+{
+  long i;
+
+  for (i = 0; i < len; i++)
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+  return hash;
+}
@@ -0,0 +1,103 @@
+// ** es1.h - ES-1 file format: sample headers and sample data
+// ** Reverse engineered version of Korg's ES2WAV.EXE program 
+// ** RW 040314
+
+// # samples in the ES-1
+#define MONO_SAMPLES  (100)
+#define STEREO_SAMPLES  (50)
+#define TOTAL_SAMPLES (MONO_SAMPLES+STEREO_SAMPLES)
+#define ES1_SAMPLERATE (32000)
+#define ES1_SAMPLEBITS (16)
+
+// Location of stuff in input file (.es1)
+#define HEADERPOS (524288L)
+#define SAMPLESPOS (655360L) // not used ?
+
+// Size of sample headers in .es1 file
+#define MONO_SAMPLEHEAD_SIZE (26)
+#define STEREO_SAMPLEHEAD_SIZE (28)
+
+// Sample headers follow the 20 byte file header at HEADERPOS
+#define SAMPLEHEADS_POS (HEADERPOS + 20)
+#define SAMPLEHEADS_END (SAMPLEHEADS_POS + \
+                         MONO_SAMPLES * MONO_SAMPLEHEAD_SIZE + \
+                         STEREO_SAMPLES * STEREO_SAMPLEHEAD_SIZE)
+
+// Offset for sample addresses in the sample headers
+#define ADDR_OFFSET (393216L)
+
+// Start value of FNV-1a 64 bit hash, see fnv1a()
+#define FNV1A_INIT (14695981039346656037ULL)
+
+// Size of .wav header (RIFF + fmt + data chunk headers)
+#define WAVHEADER_SIZE (44)
+
+// Mono sample header offsets
+enum msamplehead
+{
+  MSMPLHEAD_ST_H = 0, MSMPLHEAD_ST_M, MSMPLHEAD_ST_L,
+  MSMPLHEAD_END_H, MSMPLHEAD_END_M, MSMPLHEAD_END_L,
+  MSMPLHEAD_STADDR_H, MSMPLHEAD_STADDR_M, MSMPLHEAD_STADDR_L,
+  MSMPLHEAD_ENDADDR_H, MSMPLHEAD_ENDADDR_M, MSMPLHEAD_ENDADDR_L,
+  MSMPLHEAD_STATUS = 21
+};
+
+enum ssamplehead
+{
+  SSMPLHEAD_END_H = 3, SSMPLHEAD_END_M, SSMPLHEAD_END_L,
+  SSMPLHEAD_STADDR_H, SSMPLHEAD_STADDR_M, SSMPLHEAD_STADDR_L,
+  SSMPLHEAD_STATUS = 21,
+  SSMPLHEAD_ST_H = 22, SSMPLHEAD_ST_M, SSMPLHEAD_ST_L,
+  SSMPLHEAD_ENDADDR_H, SSMPLHEAD_ENDADDR_M, SSMPLHEAD_ENDADDR_L
+};
+
+
+// Raw sample header fields of all samples, indexed by sampleno, as read
+// by read_slottable(). st, end, staddr and endaddr are the 24 bit
+// big endian fields as stored; status 255 means no sample.
+struct slottable
+{
+  long st[TOTAL_SAMPLES];
+  long end[TOTAL_SAMPLES];
+  long staddr[TOTAL_SAMPLES];
+  long endaddr[TOTAL_SAMPLES];
+  unsigned char status[TOTAL_SAMPLES];
+};
+
+
+// Sample info structure.
+// We create this ourselves after reading the .es1 file sample headers
+// One for each sample
+struct sampleinf
+{
+  int  sampleno;
+  int  status;
+  long startaddr;
+  long lenbytes;
+  long lensamples;
+};
+
+
+int check_signature(FILE *infile);
+int read_slottable(FILE *infile, struct slottable *slots);
+int read_sampleheaders(FILE *infile, struct sampleinf *sampleinfo);
+int read_rawsampleheaders(FILE *infile, struct sampleinf *sampleinfo);
+int write_samples(FILE *infile, unsigned char *outbuf, struct sampleinf *info);
+int decode_samples(FILE *infile, struct sampleinf *info, 
+                   short *left, short *right, long stride);
+int decode_range(FILE *infile, struct sampleinf *info, long start, long end,
+                 short *left, short *right, long stride);
+long sample_frames(struct sampleinf *info);
+int check_sampleinfo(struct sampleinf *info);
+long sample_databytes(struct sampleinf *info);
+int sample_envelope(FILE *infile, struct sampleinf *info,
+                    short *minval, short *maxval);
+void sample_name(char *namebuf, int sampleno);
+int parse_sample_name(char *name);
+unsigned char *put_wav_header(long channels, long samplebytes,
+                              unsigned char *buf);
+unsigned char *put_fmt_chunk(long channels, unsigned char *buf);
+unsigned char *put_32bit_le(long value, unsigned char *buf);
+unsigned char *put_16bit_le(short value, unsigned char *buf);
+unsigned long long fnv1a(unsigned long long hash, const unsigned char *data,
+                         long len);
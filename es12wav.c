@@ -6,81 +6,135 @@
 // ** 1.2  create output directory
 // ** 1.3  stereo samples fixed
 // ** 1.4  wav output not cpu-endian-dependent
-
+// ** 1.5  preallocated output files, optional direct I/O
+// ** 1.6  combined output files with cue labels
+// ** 1.7  content-addressed sample store
+// ** 1.8  validation of input file
+// ** 1.9  daemon mode
+// ** 1.10 conversion of part of a sample
+// ** 1.11 decoder self check
+// ** 1.12 comparison of two input files
+// ** 1.13 decoder statistics, frame cache
+// ** 1.14 silence trimming and normalization
+// ** 1.15 decoder profiling
+// ** 1.16 compact container of compressed samples
+// ** 1.17 es1file from stdin
+// ** 1.18 envelope preview
+// ** 1.19 arena file of all samples
+// ** 1.20 watch mode
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "adpcm.h"
+#include "es1.h"
+#include "daemon.h"
+#include "adpcmcheck.h"
+#include "diff.h"
+#include "export.h"
+#include "profile.h"
+#include "es1c.h"
+#include "arena.h"
+#include "watch.h"
+#include "sha256.h"
 
 
 #define DEBUG (0)
 
-// # samples in the ES-1
-#define MONO_SAMPLES  (100)
-#define STEREO_SAMPLES  (50)
-#define TOTAL_SAMPLES (MONO_SAMPLES+STEREO_SAMPLES)
-#define ES1_SAMPLERATE (32000)
-#define ES1_SAMPLEBITS (16)
+// Output files are written in blocks of this size, with buffers and
+// block sizes aligned to DIRECT_ALIGN so that O_DIRECT can be used
+#define WRITE_BLOCKSIZE (1048576L)
+#define DIRECT_ALIGN (4096L)
 
-// Location of stuff in input file (.es1)
-#define HEADERPOS (524288L)
-#define SAMPLESPOS (655360L) // not used ?
+// Combined output files (all mono samples in one, all stereo in the other)
+#define COMBINED_MONO_FILE "mono.wav"
+#define COMBINED_STEREO_FILE "stereo.wav"
 
-// Size of sample headers in .es1 file
-#define MONO_SAMPLEHEAD_SIZE (26)
-#define STEREO_SAMPLEHEAD_SIZE (28)
+// Size of cue point in cue chunk, and of labl and ltxt chunks (with
+// 4 byte label) in LIST adtl chunk, all including chunk headers
+#define CUEPOINT_SIZE (24)
+#define LABL_SIZE (16)
+#define LTXT_SIZE (28)
 
-// Offset for sample addresses in the sample headers
-#define ADDR_OFFSET (393216L)
+// Number of random frames for decoder self check (-t)
+#define CHECK_RANDOMFRAMES (1000000L)
 
-// Mono sample header offsets
-enum msamplehead
-{
-  MSMPLHEAD_ST_H = 0, MSMPLHEAD_ST_M, MSMPLHEAD_ST_L,
-  MSMPLHEAD_END_H, MSMPLHEAD_END_M, MSMPLHEAD_END_L,
-  MSMPLHEAD_STADDR_H, MSMPLHEAD_STADDR_M, MSMPLHEAD_STADDR_L,
-  MSMPLHEAD_ENDADDR_H, MSMPLHEAD_ENDADDR_M, MSMPLHEAD_ENDADDR_L,
-  MSMPLHEAD_STATUS = 21
-};
+// Info for all samples
+struct sampleinf sampleinfo[TOTAL_SAMPLES];
 
-enum ssamplehead
-{
-  SSMPLHEAD_END_H = 3, SSMPLHEAD_END_M, SSMPLHEAD_END_L,
-  SSMPLHEAD_STADDR_H, SSMPLHEAD_STADDR_M, SSMPLHEAD_STADDR_L,
-  SSMPLHEAD_STATUS = 21,
-  SSMPLHEAD_ST_H = 22, SSMPLHEAD_ST_M, SSMPLHEAD_ST_L,
-  SSMPLHEAD_ENDADDR_H, SSMPLHEAD_ENDADDR_M, SSMPLHEAD_ENDADDR_L
-};
+// Open output files with O_DIRECT (bypass page cache)
+int direct_io = 0;
 
+// Write all samples to two combined files rather than one file each
+int combined = 0;
 
-// Sample info structure.
-// We create this ourselves after reading the .es1 file sample headers
-// One for each sample
-struct sampleinf
+// Sample store directory (absolute path), or NULL if not used
+char *storedir = NULL;
+int stored_samples = 0;
+int reused_samples = 0;
+
+// umask, for files created with mkstemp()
+mode_t file_mask;
+
+// Trimming and normalization of samples written by write_wavfile()
+struct exportopts exportopts;
+
+
+// Output file written sequentially in blocks, for write_combined()
+struct outputfile
 {
-  int  sampleno;
-  int  status;
-  long startaddr;
-  long lenbytes;
-  long lensamples;
+  int fd;
+  int direct;               // opened with O_DIRECT
+  unsigned char *block;     // WRITE_BLOCKSIZE bytes, aligned to DIRECT_ALIGN
+  long fill;                // # bytes in block
+  long pos;                 // file position of block
 };
 
 
-// Info for all samples
-struct sampleinf sampleinfo[TOTAL_SAMPLES];
+// Area of input file occupied by one channel of a sample, for validation
+struct area
+{
+  long start;
+  long end;
+  int sampleno;
+};
 
 
 // Prototypes
-int process_file(FILE *infile);
-int read_sampleheaders(FILE *infile);
-int write_wavfile(FILE *infile, char *filename, struct sampleinf *info);
-int write_samples(FILE *infile, FILE *outfile, struct sampleinf *info);
-int write_32bit_le(long value, FILE *file);
-int write_16bit_le(short value, FILE *file);
+int process_file(FILE *infile, int dirfd);
+int process_stream(FILE *infile, int dirfd);
+int compare_startaddr(const void *a, const void *b);
+void uncompress_twice(unsigned char inbuf[FRAMESIZE], 
+                      short outbuf[FRAMESIZE]);
+int check_decoders(void);
+int diff_main(char *oldfilename, char *infilename, char *dirname);
+int validate_file(FILE *infile);
+int write_envelopes(FILE *infile);
+int compare_areas(const void *a, const void *b);
+int write_wavfile(FILE *infile, int dirfd, char *filename,
+                  struct sampleinf *info);
+int write_range(FILE *infile, char *rangespec, char *filename);
+int write_combined(FILE *infile, int dirfd, char *filename, 
+                   struct sampleinf *sampleinfo, int no_of_samples, 
+                   int stereo);
+int store_sample(FILE *infile, int dirfd, char *filename, 
+                 struct sampleinf *info);
+int fingerprint(FILE *infile, struct sampleinf *info, 
+                unsigned char *digest);
+int write_file(int dirfd, char *filename, unsigned char *buf, long filesize);
+int open_output(struct outputfile *out, int dirfd, char *filename, 
+                long filesize);
+int append_output(struct outputfile *out, unsigned char *data, long len);
+int close_output(struct outputfile *out);
+int open_direct(int dirfd, char *filename, int *direct);
 
 // Code
 
@@ -89,32 +143,259 @@ int main(int argc, char **argv)
   char *infilename, *dirname;
   FILE *infile;
   int status;
+  int opt;
+  int badopt = 0;
+  int validate = 0;
+  int check = 0;
+  int stats = 0;
+  int envelope = 0;
+  char *socketname = NULL;
+  char *spooldir = NULL;
+  char *rangespec = NULL;
+  char *oldfilename = NULL;
+  char *profilename = NULL;
+  char *containername = NULL;
+  char *arenaname = NULL;
+  char startdir[PATH_MAX];
+  static struct decoderprofile profile;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  while ((opt = getopt(argc, argv, "a:cdef:ij:l:mn:o:p:r:s:tvwx:z:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'a': containername = optarg; break;
+      case 'o': arenaname = optarg; break;
+      case 'x': oldfilename = optarg; break;
+      case 't': check = 1; break;
+      case 'r': rangespec = optarg; break;
+      case 'j': threads = atoi(optarg); break;
+      case 'l': socketname = optarg; break;
+      case 'f': spooldir = optarg; break;
+      case 'm': frame_cache = 1; break;
+      case 'v': validate = 1; break;
+      case 'w': envelope = 1; break;
+      case 'c': combined = 1; break;
+      case 'd': direct_io = 1; break;
+      case 'i': stats = 1; break;
+      case 's': storedir = optarg; break;
+      case 'z': badopt |= parse_trim_level(optarg, &exportopts); break;
+      case 'n': badopt |= parse_normalization(optarg, &exportopts); break;
+      case 'e': exportopts.dither = 1; break;
+      case 'p': profilename = optarg; break;
+      default: badopt = 1; break;
+    }
+  }
 
-  if (argc < 3)
+  if (threads < 1)
+    threads = 1;
+
+  // After all options, so that -t checks the decoder as they set it up
+  if (check && !badopt)
+    return check_decoders();
+
+  // Trimming and normalization only apply to .wav files of one sample
+  if (export_active(&exportopts) && (combined || storedir != NULL))
+    badopt = 1;
+  // Dither only applies to normalized samples
+  if (exportopts.dither && exportopts.normalization == NORMALIZE_NONE)
+    badopt = 1;
+
+  if (badopt || 
+      argc - optind < (socketname != NULL ? 0 : spooldir != NULL ? 1 :
+                       (validate || envelope || oldfilename != NULL ||
+                        containername != NULL || 
+                        arenaname != NULL) ? 1 : 2))
   { 
-    fprintf(stderr, "es12wav  v1.4\n");
-    fprintf(stderr, "Usage: es12wav <es1file> <new-directory>\n");
+    fprintf(stderr, "es12wav  v1.20\n");
+    fprintf(stderr, "Usage: es12wav [-cdim] [-s <storedir>] "
+                    "[-p <jsonfile>] <es1file> <new-directory>\n");
+    fprintf(stderr, "       es12wav [-dime] [-z <dBFS>] "
+                    "[-n peak|rms[:<dBFS>]] <es1file> <new-directory>\n");
+    fprintf(stderr, "       es12wav -v <es1file>\n");
+    fprintf(stderr, "       es12wav -w <es1file>\n");
+    fprintf(stderr, "       es12wav -a <es1cfile> <es1file>\n");
+    fprintf(stderr, "       es12wav -o <arenafile> <es1file>\n");
+    fprintf(stderr, "       es12wav -r <sample>:<start>:[<end>] "
+                    "<es1file> <wavfile>|-\n");
+    fprintf(stderr, "       es12wav -x <old-es1file> <es1file> "
+                    "[<new-directory>]\n");
+    fprintf(stderr, "       es12wav -l <socket> [-m] [-j <threads>]\n");
+    fprintf(stderr, "       es12wav -f <spooldir> [-cdm] [-j <threads>] "
+                    "[-s <storedir>] <outdir>\n");
+    fprintf(stderr, "       es12wav -t [-m]\n");
+    fprintf(stderr, "  -a  write compressed samples to compact es1cfile, "
+                    "which can be used as es1file\n");
+    fprintf(stderr, "  -c  write all samples to %s and %s\n",
+            COMBINED_MONO_FILE, COMBINED_STEREO_FILE);
+    fprintf(stderr, "  -d  write output files using direct I/O\n");
+    fprintf(stderr, "  -e  add TPDF dither when normalizing (with -n)\n");
+    fprintf(stderr, "  -f  watch spooldir, convert each new es1file to "
+                    "its own directory in outdir\n");
+    fprintf(stderr, "  -i  print decoder statistics\n");
+    fprintf(stderr, "  -j  number of threads\n");
+    fprintf(stderr, "  -l  run as daemon, serving requests on socket\n");
+    fprintf(stderr, "  -m  cache uncompressed frames, for repeated "
+                    "identical frames\n");
+    fprintf(stderr, "  -n  normalize samples to peak or RMS level "
+                    "(default %.0f / %.0f dBFS)\n",
+            DEFAULT_PEAK_LEVEL, DEFAULT_RMS_LEVEL);
+    fprintf(stderr, "  -o  uncompress all samples into one arena file, "
+                    "for mmap\n");
+    fprintf(stderr, "  -p  add histograms of decoder state to jsonfile\n");
+    fprintf(stderr, "  -r  convert samples start..end-1 of one sample, "
+                    "e.g. 12s:32000:64000\n");
+    fprintf(stderr, "  -s  keep samples in content-addressed store, "
+                    "link them from new-directory\n");
+    fprintf(stderr, "  -t  check decoder against reference decoder\n");
+    fprintf(stderr, "  -v  only check es1file for errors\n");
+    fprintf(stderr, "  -w  write min/max envelope of each frame as CSV, "
+                    "from frame headers only\n");
+    fprintf(stderr, "  -x  compare with old-es1file, convert only added "
+                    "and modified samples\n");
+    fprintf(stderr, "  -z  trim leading and trailing silence at or below "
+                    "level\n");
+    fprintf(stderr, "  es1file - is read from stdin, which need not be "
+                    "seekable\n");
     exit(1);
   }
 
   assert(sizeof(short) == 2);
   assert(sizeof(long) >= 4);
 
-  dirname = argv[2];
+  if (socketname != NULL)
+    return run_daemon(socketname, threads);
+
+  if (rangespec != NULL)
+  {
+    infilename = argv[optind];
+    infile = fopen(infilename, "rb");
+    if (infile == NULL)
+    {
+      fprintf(stderr, "Can't open %s!\n", infilename);
+      exit(1);
+    }
+    status = write_range(infile, rangespec, argv[optind + 1]);
+    fclose(infile);
+    if (status != 0)
+      fprintf(stderr, "Error converting %s\n", rangespec);
+    return status;
+  }
+
+  if (containername != NULL)
+  {
+    infilename = argv[optind];
+    infile = fopen(infilename, "rb");
+    if (infile == NULL)
+    {
+      fprintf(stderr, "Can't open %s!\n", infilename);
+      exit(1);
+    }
+    status = write_container(infile, containername);
+    fclose(infile);
+    if (status != 0)
+      fprintf(stderr, "Error writing %s\n", containername);
+    return status;
+  }
+
+  if (arenaname != NULL)
+  {
+    infilename = argv[optind];
+    infile = fopen(infilename, "rb");
+    if (infile == NULL)
+    {
+      fprintf(stderr, "Can't open %s!\n", infilename);
+      exit(1);
+    }
+    status = write_arena(infile, arenaname);
+    fclose(infile);
+    if (status != 0)
+      fprintf(stderr, "Error writing %s\n", arenaname);
+    return status;
+  }
+
+  if (oldfilename != NULL)
+    return diff_main(oldfilename, argv[optind], 
+                     (argc - optind > 1) ? argv[optind + 1] : NULL);
+
+  if (envelope)
+  {
+    infilename = argv[optind];
+    infile = fopen(infilename, "rb");
+    if (infile == NULL)
+    {
+      fprintf(stderr, "Can't open %s!\n", infilename);
+      exit(1);
+    }
+    status = write_envelopes(infile);
+    fclose(infile);
+    return status;
+  }
+
+  if (validate)
+  {
+    infilename = argv[optind];
+    infile = fopen(infilename, "rb");
+    if (infile == NULL)
+    {
+      fprintf(stderr, "Can't open %s!\n", infilename);
+      exit(1);
+    }
+    status = validate_file(infile);
+    fclose(infile);
+    printf("%s: %s\n", infilename, status == 0 ? "OK" : "BAD");
+    return status;
+  }
+
+  // Store must be given as absolute path, as we chdir below
+  if (storedir != NULL)
+  {
+    if (mkdir(storedir, 0777) < 0 && errno != EEXIST)
+    {
+      perror("Error creating store directory");
+      exit(1);
+    }
+    storedir = realpath(storedir, NULL);
+    if (storedir == NULL)
+    {
+      perror("Error finding store directory");
+      exit(1);
+    }
+    // Reading the umask means setting it, so do it once, before any
+    // threads that create files are started
+    file_mask = umask(0);
+    umask(file_mask);
+  }
+
+  if (spooldir != NULL)
+    return run_watch(spooldir, argv[optind], threads, process_file);
+
+  dirname = argv[optind + 1];
   if (mkdir(dirname, 0777) < 0)
   {
     perror("Error creating directory");
     exit(1);
   }
 
-  infilename = argv[1];
-  infile = fopen(infilename, "rb");
+  // es1file "-" is read from stdin, as a stream
+  infilename = argv[optind];
+  if (strcmp(infilename, "-") == 0)
+    infile = stdin;
+  else
+    infile = fopen(infilename, "rb");
   if (infile == NULL)
   {
     fprintf(stderr, "Can't open %s!\n", infilename);
     exit(1);
   }
 
+  if (getcwd(startdir, sizeof startdir) == NULL)
+  {
+    perror("Error finding current directory");
+    fclose(infile);
+    exit(1);
+  }
+
   if (chdir(dirname) < 0)
   {
     perror("Error changing directory");
@@ -122,10 +403,39 @@ int main(int argc, char **argv)
     exit(1);
   }
 
-  status = process_file(infile);
+  if (profilename != NULL)
+    decoder_profile = &profile;
+  if (infile == stdin)
+    status = process_stream(infile, AT_FDCWD);
+  else
+    status = process_file(infile, AT_FDCWD);
+  decoder_profile = NULL;
 
   fclose(infile);
 
+  if (storedir != NULL)
+    printf("%d samples added to store, %d already stored.\n",
+           stored_samples, reused_samples);
+
+  if (stats)
+    printf("%lu frames uncompressed, %lu constant (%.1f%%).\n",
+           frames_decoded, frames_constant,
+           frames_decoded ? 100.0 * frames_constant / frames_decoded : 0.0);
+  if (stats && frame_cache)
+    printf("%lu frame cache hits, %lu misses (%.1f%%).\n",
+           cache_hits, cache_misses, cache_hits + cache_misses ?
+           100.0 * cache_hits / (cache_hits + cache_misses) : 0.0);
+
+  // Profile file name is relative to where we started
+  if (profilename != NULL && status == 0)
+  {
+    if (chdir(startdir) < 0 || write_profile(profilename, &profile) != 0)
+    {
+      fprintf(stderr, "Error writing profile %s\n", profilename);
+      status = 2;
+    }
+  }
+
   switch (status)
   {
     case 0: printf("Done.\n"); break;
@@ -138,50 +448,134 @@ int main(int argc, char **argv)
 }
 
 
-int process_file(FILE *infile)
+// Uncompress frame twice, so that with the frame cache the result
+// comes from the cache entry made by the first call
+void uncompress_twice(unsigned char inbuf[FRAMESIZE], 
+                      short outbuf[FRAMESIZE])
 {
-  char buf[20];
-  char namebuf[10];
-  int no_of_samples;
-  int waveno;
-  int sampleno;
+  uncompress(inbuf, outbuf);
+  uncompress(inbuf, outbuf);
+}
+
+
+// Check decoder against the reference decoder (-t), as is, with the
+// frame cache, and with decoder profiling, which uses the same loop
+// with counting added. Return 1 if mismatch, else 0.
+int check_decoders(void)
+{
+  struct decoderprofile profile;
+  int saved_cache;
   int status;
 
-  // Sanity check on input file
+  status = check_decoder(uncompress, CHECK_RANDOMFRAMES, 1);
+  if (status == 0)
+  {
+    printf("With frame cache:\n");
+    saved_cache = frame_cache;
+    frame_cache = 1;
+    status = check_decoder(uncompress_twice, CHECK_RANDOMFRAMES, 1);
+    frame_cache = saved_cache;
+  }
+  if (status == 0)
+  {
+    printf("With decoder profile:\n");
+    memset(&profile, 0, sizeof profile);
+    decoder_profile = &profile;
+    status = check_decoder(uncompress, CHECK_RANDOMFRAMES, 1);
+    decoder_profile = NULL;
+  }
+  return status;
+}
+
+
+// Compare oldfilename with infilename, and convert added and modified
+// samples to dirname if not NULL.
+int diff_main(char *oldfilename, char *infilename, char *dirname)
+{
+  struct sampleinf changed[TOTAL_SAMPLES];
+  FILE *oldfile, *infile;
+  char namebuf[16];
+  int no_changed;
+  int waveno;
+  int status;
 
-  fread(buf, 1, 20, infile);
-  if (strncmp(buf, "KORG", 4) != 0 || buf[6] != 87)
+  oldfile = fopen(oldfilename, "rb");
+  if (oldfile == NULL)
   {
-    fprintf(stderr, "Not an ES1 file! (1)\n");
+    fprintf(stderr, "Can't open %s!\n", oldfilename);
     return 1;
   }
-
-  fseek(infile, HEADERPOS, SEEK_SET);
-  fread(buf, 1, 20, infile);
-  if (strncmp(buf, "KORG", 4) != 0 || buf[6] != 87)
+  infile = fopen(infilename, "rb");
+  if (infile == NULL)
   {
-    fprintf(stderr, "Not an ES1 file! (2)\n");
+    fprintf(stderr, "Can't open %s!\n", infilename);
+    fclose(oldfile);
     return 1;
   }
 
-  // Read sample headers
-  no_of_samples = read_sampleheaders(infile);
+  no_changed = diff_files(oldfile, infile, changed);
+  fclose(oldfile);
+  status = (no_changed < 0);
+
+  if (status == 0 && dirname != NULL && no_changed > 0)
+  {
+    if (mkdir(dirname, 0777) < 0 || chdir(dirname) < 0)
+    {
+      perror("Error creating directory");
+      fclose(infile);
+      return 1;
+    }
+    for (waveno = 0; waveno < no_changed && status == 0; waveno++)
+    {
+      sample_name(namebuf, changed[waveno].sampleno);
+      strcat(namebuf, ".wav");
+      status = write_wavfile(infile, AT_FDCWD, namebuf, &changed[waveno]);
+    }
+  }
+
+  fclose(infile);
+  return status;
+}
+
+
+int process_file(FILE *infile, int dirfd)
+{
+  struct sampleinf sampleinfo[TOTAL_SAMPLES];
+  char namebuf[16];
+  int no_of_samples;
+  int waveno;
+  int status;
+
+  // Read sample headers, of ES-1 file or container, with sanity check
+  no_of_samples = read_sampleindex(infile, sampleinfo);
+  if (no_of_samples < 0)
+    return 1;
   if (no_of_samples == 0)
   {
     printf("No data in input file.\n");
     return 0;
   }
 
+  if (combined)
+  {
+    status = write_combined(infile, dirfd, COMBINED_MONO_FILE, 
+                            sampleinfo, no_of_samples, 0);
+    if (status == 0)
+      status = write_combined(infile, dirfd, COMBINED_STEREO_FILE, 
+                              sampleinfo, no_of_samples, 1);
+    return status;
+  }
+
   // Process each sample
   for (waveno = 0; waveno < no_of_samples; waveno++)
   {
-    sampleno = sampleinfo[waveno].sampleno;
-    if (sampleno < MONO_SAMPLES)
-      sprintf(namebuf, "%02d.wav", sampleno);
-    else
-      sprintf(namebuf, "%02ds.wav", sampleno - MONO_SAMPLES);
+    sample_name(namebuf, sampleinfo[waveno].sampleno);
+    strcat(namebuf, ".wav");
 
-    status = write_wavfile(infile, namebuf, &sampleinfo[waveno]);
+    if (storedir != NULL)
+      status = store_sample(infile, dirfd, namebuf, &sampleinfo[waveno]);
+    else
+      status = write_wavfile(infile, dirfd, namebuf, &sampleinfo[waveno]);
 
     if (status != 0)
       return status;
@@ -199,236 +593,851 @@ int process_file(FILE *infile)
 }
 
 
+// Like process_file(), but read infile once from start to end, without
+// seeking, so it can be a pipe. Only the file up to the end of the
+// sample headers is kept, then the data of one sample (or of a group of
+// overlapping samples) at a time, in address order.
+int process_stream(FILE *infile, int dirfd)
+{
+  struct sampleinf sorted[TOTAL_SAMPLES];
+  struct sampleinf info;
+  unsigned char *prefix;
+  unsigned char *window;
+  char namebuf[16];
+  FILE *windowfile;
+  long pos;
+  long start, end;
+  long bytes;
+  int no_of_samples;
+  int first, last;
+  int waveno;
+  int status;
+
+  if (combined)
+  {
+    fprintf(stderr, "Combined output files need a seekable es1file\n");
+    return 1;
+  }
+
+  // Everything up to the end of the sample headers
+  prefix = malloc(SAMPLEHEADS_END);
+  if (prefix == NULL)
+    return 1;
+  if (fread(prefix, 1, SAMPLEHEADS_END, infile) != SAMPLEHEADS_END)
+  {
+    fprintf(stderr, "Not an ES1 file! (short)\n");
+    free(prefix);
+    return 1;
+  }
+  pos = SAMPLEHEADS_END;
+  windowfile = fmemopen(prefix, SAMPLEHEADS_END, "rb");
+  status = (windowfile == NULL || check_signature(windowfile) != 0);
+  if (status == 0)
+  {
+    no_of_samples = read_sampleheaders(windowfile, sorted);
+    status = (no_of_samples < 0);
+  }
+  if (windowfile != NULL)
+    fclose(windowfile);
+  if (status != 0)
+  {
+    free(prefix);
+    return 1;
+  }
+  if (no_of_samples == 0)
+    printf("No data in input file.\n");
+
+  qsort(sorted, no_of_samples, sizeof sorted[0], compare_startaddr);
+
+  for (first = 0; status == 0 && first < no_of_samples; first = last)
+  {
+    // Group of samples whose data overlaps
+    start = sorted[first].startaddr;
+    end = start + sample_databytes(&sorted[first]);
+    for (last = first + 1; last < no_of_samples &&
+                           sorted[last].startaddr < end; last++)
+    {
+      if (sorted[last].startaddr + sample_databytes(&sorted[last]) > end)
+        end = sorted[last].startaddr + sample_databytes(&sorted[last]);
+    }
+    if (start < 0 || end <= start)
+    {
+      status = 1;
+      break;
+    }
+
+    // Read group data into window, taking any part before pos from
+    // prefix, as groups are in address order and don't overlap
+    window = malloc(end - start);
+    if (window == NULL)
+    {
+      status = 1;
+      break;
+    }
+    if (start < pos)
+    {
+      bytes = ((end < pos) ? end : pos) - start;
+      memcpy(window, prefix + start, bytes);
+    }
+    else
+      bytes = 0;
+    for (; pos < start && status == 0; pos++)
+      status = (getc(infile) == EOF);
+    if (status == 0 && bytes < end - start)
+    {
+      status = ((long) fread(window + bytes, 1, end - start - bytes,
+                             infile) != end - start - bytes);
+      pos = end;
+    }
+
+    windowfile = (status == 0) ? fmemopen(window, end - start, "rb") : NULL;
+    if (windowfile == NULL)
+      status = 1;
+
+    for (waveno = first; waveno < last && status == 0; waveno++)
+    {
+      info = sorted[waveno];
+      info.startaddr -= start;
+      sample_name(namebuf, info.sampleno);
+      strcat(namebuf, ".wav");
+
+      if (storedir != NULL)
+        status = store_sample(windowfile, dirfd, namebuf, &info);
+      else
+        status = write_wavfile(windowfile, dirfd, namebuf, &info);
+    }
+
+    if (windowfile != NULL)
+      fclose(windowfile);
+    free(window);
+  }
+
+  free(prefix);
+  return status;
+}
+
 
-int read_sampleheaders(FILE *infile)
+// Print coarse envelope of all samples to stdout as CSV, one line per
+// frame (32 samples) and channel, without uncompressing anything.
+// Return 1 if read error or bad format, else 0.
+int write_envelopes(FILE *infile)
 {
-  unsigned char monobuf[MONO_SAMPLEHEAD_SIZE];
-  unsigned char stereobuf[STEREO_SAMPLEHEAD_SIZE];
-  int waveno = 0;
-  int sampleno;
+  short *minval, *maxval;
   struct sampleinf *info;
+  char name[16];
+  long frames_per_channel;
+  long frameno;
+  long channels;
+  int no_of_samples;
+  int waveno;
+  int channel;
+  int status;
 
-  // Mono samples 0..99
-  for (sampleno = 0; sampleno < MONO_SAMPLES; sampleno++)
+  no_of_samples = read_sampleindex(infile, sampleinfo);
+  if (no_of_samples < 0)
+    return 1;
+
+  printf("sample,channel,frame,min,max\n");
+  status = 0;
+  for (waveno = 0; waveno < no_of_samples && status == 0; waveno++)
   {
-    fread(monobuf, sizeof monobuf, 1, infile);
-    if (monobuf[MSMPLHEAD_STATUS] != 255)
+    info = &sampleinfo[waveno];
+    channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
+    frames_per_channel = sample_frames(info);
+    minval = malloc((channels * frames_per_channel + 1) * sizeof *minval);
+    maxval = malloc((channels * frames_per_channel + 1) * sizeof *maxval);
+    status = (minval == NULL || maxval == NULL ||
+              sample_envelope(infile, info, minval, maxval) != 0);
+
+    sample_name(name, info->sampleno);
+    for (channel = 0; channel < channels && status == 0; channel++)
+      for (frameno = 0; frameno < frames_per_channel; frameno++)
+        printf("%s,%d,%ld,%d,%d\n", name, channel, frameno,
+               minval[channel * frames_per_channel + frameno],
+               maxval[channel * frames_per_channel + frameno]);
+
+    free(minval);
+    free(maxval);
+  }
+  return status;
+}
+
+
+// qsort() compare function for sampleinf, by startaddr
+int compare_startaddr(const void *a, const void *b)
+{
+  const struct sampleinf *info_a = a;
+  const struct sampleinf *info_b = b;
+
+  return (info_a->startaddr > info_b->startaddr) - 
+         (info_a->startaddr < info_b->startaddr);
+}
+
+
+// Check whole input file for errors before any conversion is done:
+// sample header ranges, overlapping samples and sample length vs. number
+// of frames. Report all errors found. Frame headers the ES-1 is not
+// known to produce are reported as warnings only, see checkframes().
+// Return 1 if any error, else 0.
+int validate_file(FILE *infile)
+{
+  unsigned char *image;
+  struct sampleinf *info;
+  struct area areas[2 * TOTAL_SAMPLES];
+  char name[16];
+  long filesize;
+  long frames;
+  long channels;
+  long badframes;
+  long maxend;
+  int maxend_sampleno;
+  int no_of_samples;
+  int no_of_areas;
+  int errors;
+  int waveno;
+  int i;
+
+  if (check_signature(infile) != 0)
+    return 1;
+
+  // Read whole file, frames are checked in memory
+  fseek(infile, 0, SEEK_END);
+  filesize = ftell(infile);
+  if (filesize < SAMPLEHEADS_END)
+  {
+    fprintf(stderr, "File truncated in sample headers\n");
+    return 1;
+  }
+  image = malloc(filesize);
+  if (image == NULL)
+    return 1;
+  rewind(infile);
+  if (fread(image, 1, filesize, infile) != filesize)
+  {
+    free(image);
+    return 1;
+  }
+
+  fseek(infile, SAMPLEHEADS_POS, SEEK_SET);
+  no_of_samples = read_rawsampleheaders(infile, sampleinfo);
+  if (no_of_samples < 0)
+  {
+    free(image);
+    return 1;
+  }
+
+  errors = 0;
+  no_of_areas = 0;
+  for (waveno = 0; waveno < no_of_samples; waveno++)
+  {
+    info = &sampleinfo[waveno];
+    sample_name(name, info->sampleno);
+    channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
+    frames = sample_frames(info);
+
+    if (info->lensamples <= 0 || info->lenbytes <= 0)
     {
-      info = &sampleinfo[waveno];
-      info->sampleno = sampleno;
-      info->status = monobuf[MSMPLHEAD_STATUS];
-      info->lensamples = (monobuf[MSMPLHEAD_END_H] << 16) + 
-                         (monobuf[MSMPLHEAD_END_M] << 8) +
-                          monobuf[MSMPLHEAD_END_L] -
-                         (monobuf[MSMPLHEAD_ST_H] << 16) -
-                         (monobuf[MSMPLHEAD_ST_M] << 8) -
-                          monobuf[MSMPLHEAD_ST_L] + 1;
-      info->lenbytes = (monobuf[MSMPLHEAD_ENDADDR_H] << 16) + 
-                       (monobuf[MSMPLHEAD_ENDADDR_M] << 8) +
-                        monobuf[MSMPLHEAD_ENDADDR_L] -
-                       (monobuf[MSMPLHEAD_STADDR_H] << 16) -
-                       (monobuf[MSMPLHEAD_STADDR_M] << 8) -
-                        monobuf[MSMPLHEAD_STADDR_L] + 1;
-      info->startaddr = (monobuf[MSMPLHEAD_STADDR_H] << 16) +
-                        (monobuf[MSMPLHEAD_STADDR_M] << 8) +
-                         monobuf[MSMPLHEAD_STADDR_L] - ADDR_OFFSET;
-#if DEBUG
-      printf("MSample %d, status %d, lensamples %ld, lenbytes %ld, addr %ld\n", 
-             info->sampleno, info->status, 
-             info->lensamples, info->lenbytes, info->startaddr);
-#endif
-      waveno++;
+      fprintf(stderr, "Sample %s: empty (%ld samples, %ld bytes)\n", name,
+              info->lensamples, info->lenbytes);
+      errors++;
+      continue;
+    }
+    // Data before the sample headers end is accepted, as it is when
+    // converting (also from a stream)
+    if (info->startaddr < 0 || 
+        info->startaddr + channels * info->lenbytes > filesize)
+    {
+      fprintf(stderr, "Sample %s: data at %ld..%ld outside file "
+              "0..%ld\n", name, info->startaddr,
+              info->startaddr + channels * info->lenbytes, filesize);
+      errors++;
+      continue;
+    }
+    if (frames * FRAMESIZE > info->lenbytes)
+    {
+      fprintf(stderr, "Sample %s: %ld samples need %ld frames, "
+              "but only %ld bytes\n", name, info->lensamples / channels,
+              frames, info->lenbytes);
+      errors++;
+      // Only check the frames that are there
+      frames = info->lenbytes / FRAMESIZE;
+    }
+
+    for (i = 0; i < channels; i++)
+    {
+      areas[no_of_areas].start = info->startaddr + i * info->lenbytes;
+      areas[no_of_areas].end = areas[no_of_areas].start + info->lenbytes;
+      areas[no_of_areas].sampleno = info->sampleno;
+      no_of_areas++;
+      badframes = checkframes(image + info->startaddr + i * info->lenbytes, 
+                              frames);
+      if (badframes > 0)
+        fprintf(stderr, "Sample %s: warning: %ld of %ld frames have "
+                "unusual headers\n", name, badframes, frames);
     }
   }
 
-  // stereo samples 100..149
-  for (sampleno = 0; sampleno < STEREO_SAMPLES; sampleno++)
+  // Sort areas by start address, then each must start after all before
+  // it have ended. The one ending last is the one any overlap is with.
+  qsort(areas, no_of_areas, sizeof areas[0], compare_areas);
+  maxend = 0;
+  maxend_sampleno = 0;
+  for (i = 0; i < no_of_areas; i++)
   {
-    fread(stereobuf, sizeof stereobuf, 1, infile);
-    if (stereobuf[SSMPLHEAD_STATUS] != 255)
+    if (i > 0 && areas[i].start < maxend)
     {
-      info = &sampleinfo[waveno];
-      info->sampleno = sampleno + MONO_SAMPLES;
-      info->status = stereobuf[SSMPLHEAD_STATUS];
-      info->lensamples = ((stereobuf[SSMPLHEAD_END_H] << 16) + 
-                          (stereobuf[SSMPLHEAD_END_M] << 8) +
-                           stereobuf[SSMPLHEAD_END_L] -
-                          (stereobuf[SSMPLHEAD_ST_H] << 16) -
-                          (stereobuf[SSMPLHEAD_ST_M] << 8) -
-                           stereobuf[SSMPLHEAD_ST_L] + 1) * 2;
-      info->lenbytes = (stereobuf[SSMPLHEAD_ENDADDR_H] << 16) + 
-                       (stereobuf[SSMPLHEAD_ENDADDR_M] << 8) +
-                        stereobuf[SSMPLHEAD_ENDADDR_L] -
-                       (stereobuf[SSMPLHEAD_STADDR_H] << 16) -
-                       (stereobuf[SSMPLHEAD_STADDR_M] << 8) -
-                        stereobuf[SSMPLHEAD_STADDR_L];     // no + 1 !
-      info->startaddr = (stereobuf[SSMPLHEAD_STADDR_H] << 16) +
-                        (stereobuf[SSMPLHEAD_STADDR_M] << 8) +
-                         stereobuf[SSMPLHEAD_STADDR_L] - ADDR_OFFSET;
-#if DEBUG
-      printf("SSample %d, status %d, lensamples %ld, lenbytes %ld, addr %ld\n", 
-             info->sampleno, info->status, 
-             info->lensamples, info->lenbytes, info->startaddr);
-#endif
-      waveno++;
+      sample_name(name, maxend_sampleno);
+      fprintf(stderr, "Sample %s overlaps ", name);
+      sample_name(name, areas[i].sampleno);
+      fprintf(stderr, "sample %s at %ld\n", name, areas[i].start);
+      errors++;
+    }
+    if (areas[i].end > maxend)
+    {
+      maxend = areas[i].end;
+      maxend_sampleno = areas[i].sampleno;
     }
   }
 
-  return waveno;
+  free(image);
+  return errors > 0;
+}
+
+
+// Compare start addresses of two areas, for qsort()
+int compare_areas(const void *a, const void *b)
+{
+  const struct area *area_a = a;
+  const struct area *area_b = b;
+
+  return (area_a->start > area_b->start) - (area_a->start < area_b->start);
 }
 
 
-int write_wavfile(FILE *infile, char *filename, struct sampleinf *info)
+int write_wavfile(FILE *infile, int dirfd, char *filename,
+                  struct sampleinf *info)
 {
-  FILE *outfile;
+  unsigned char *buf, *p;
+  short *samples;
+  long sampleno;
   long samplebytes;
   long channels;
-  long fmt_headerlen;
-  long totallength;
+  long filesize;
   int status;
-  // fmtheader:
-  short tag_sh;
-  short channels_sh;
-  long sample_rate;
-  long data_rate;
-  short blk_algn_sh;
-  short bits_per_sample_sh;
  
 
 #if 1 // always do this
   printf("Creating %s from sample# %d\n", filename, info->sampleno);
 #endif
 
+  // Buffer is sized from the header, so it must be sane, whatever
+  // sampleinfo came from
+  if (check_sampleinfo(info) != 0)
+  {
+    fprintf(stderr, "Bad sample header of sample# %d\n", info->sampleno);
+    return 1;
+  }
+
   channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
 
-  outfile = fopen(filename, "wb");
-  if (outfile == NULL)
+  samplebytes = info->lensamples * 2;
+  filesize = samplebytes + WAVHEADER_SIZE;
+
+  // The whole file is built in memory and written in one go, so that
+  // it can be preallocated to its exact size. The buffer is aligned
+  // for O_DIRECT, so that write_file() needn't copy it.
+  if (posix_memalign((void **) &buf, DIRECT_ALIGN, filesize) != 0)
     return 2;
 
-  samplebytes = info->lensamples * 2;
-  totallength = samplebytes + 36; // sizeof fmtheader
+  if (!export_active(&exportopts))
+  {
+    p = put_wav_header(channels, samplebytes, buf);
+
+    // Uncompress samples into buffer
+    status = write_samples(infile, p, info);
+    if (status == 0)
+      status = write_file(dirfd, filename, buf, filesize);
+
+    free(buf);
+    return status;
+  }
 
-  tag_sh = 1;
-  channels_sh = (short) channels;
-  
-  sample_rate = ES1_SAMPLERATE;
-  data_rate = sample_rate * channels * 2;
-  blk_algn_sh = channels_sh * 2;
-  bits_per_sample_sh = ES1_SAMPLEBITS;
+  // Uncompress samples after header, trim and normalize them there, and
+  // put header with trimmed size before them
+  samples = (short *) (buf + WAVHEADER_SIZE);
+  status = decode_samples(infile, info, samples, samples + 1, channels);
+  if (status == 0)
+  {
+    samplebytes = process_samples(samples, info->lensamples / channels,
+                                  channels, &exportopts, info->sampleno + 1)
+                  * channels * 2;
+    filesize = samplebytes + WAVHEADER_SIZE;
+    put_wav_header(channels, samplebytes, buf);
+    for (sampleno = 0; sampleno < samplebytes / 2; sampleno++)
+      put_16bit_le(samples[sampleno], buf + WAVHEADER_SIZE + sampleno * 2);
+    status = write_file(dirfd, filename, buf, filesize);
+  }
 
-  // Write file
+  free(buf);
+  return status;
+}
 
-  // .WAV header
-  fwrite("RIFF", sizeof (char), 4, outfile);
-  write_32bit_le(totallength, outfile);
-  fwrite("WAVE", sizeof (char), 4, outfile);
 
-  // fmt chunk
-  fmt_headerlen = 16;
-  fwrite("fmt ", sizeof (char), 4, outfile);  
-  write_32bit_le(fmt_headerlen, outfile);
+// Write samples start..end-1 of one sample to .wav file filename, or
+// stdout if filename is "-". The sample and range are given as
+// "<sample>:<start>:<end>", where <sample> is a sample name such as "07" 
+// or "12s", and an empty <end> means end of sample.
+// Return 1 if bad range or read error, 2 if write error, else 0.
+int write_range(FILE *infile, char *rangespec, char *filename)
+{
+  struct sampleinf *info;
+  unsigned char *buf, *p;
+  short *samples;
+  char name[16];
+  char *colon, *end;
+  long start, stop;
+  long channels;
+  long samplebytes;
+  long filesize;
+  long sampleno;
+  int no_of_samples;
+  int waveno;
+  int status;
 
-  write_16bit_le(tag_sh, outfile);
-  write_16bit_le(channels_sh, outfile);
-  write_32bit_le(sample_rate, outfile);
-  write_32bit_le(data_rate, outfile);
-  write_16bit_le(blk_algn_sh, outfile);
-  write_16bit_le(bits_per_sample_sh, outfile);
+  colon = strchr(rangespec, ':');
+  if (colon == NULL || colon - rangespec >= sizeof name)
+    return 1;
+  memcpy(name, rangespec, colon - rangespec);
+  name[colon - rangespec] = '\0';
+  sampleno = parse_sample_name(name);
+  start = strtol(colon + 1, &end, 10);
+  if (sampleno < 0 || end == colon + 1 || *end != ':')
+    return 1;
 
-  // data chunk
-  fwrite("data", sizeof (char), 4, outfile); // data chunk
-  status = write_32bit_le(samplebytes, outfile);
-  if (status != 0)
+  no_of_samples = read_sampleindex(infile, sampleinfo);
+  if (no_of_samples < 0)
+    return 1;
+  info = NULL;
+  for (waveno = 0; waveno < no_of_samples; waveno++)
   {
-    fclose(outfile);
-    return 2;
+    if (sampleinfo[waveno].sampleno == sampleno)
+      info = &sampleinfo[waveno];
+  }
+  if (info == NULL)
+  {
+    fprintf(stderr, "No sample %s in input file\n", name);
+    return 1;
   }
 
-  // Go to start address of sample in infile
-  status = fseek(infile, info->startaddr, SEEK_SET);
-  if (status != 0)
+  channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
+  if (end[1] == '\0')
+    stop = info->lensamples / channels;
+  else
+    stop = strtol(end + 1, &end, 10);
+  if (*end != '\0' && *end != ':')
+    return 1;
+  if (start < 0 || stop > info->lensamples / channels || start > stop)
+  {
+    fprintf(stderr, "Sample %s has %ld samples\n", name, 
+            info->lensamples / channels);
     return 1;
+  }
 
-  // Uncompress and write samples to outfile
-  status = write_samples(infile, outfile, info);
-  if (status != 0)
+  samplebytes = (stop - start) * channels * 2;
+  filesize = samplebytes + WAVHEADER_SIZE;
+  if (posix_memalign((void **) &buf, DIRECT_ALIGN, filesize) != 0)
+    return 2;
+
+  p = put_wav_header(channels, samplebytes, buf);
+  samples = (short *) p;
+  status = decode_range(infile, info, start, stop, samples, samples + 1,
+                        channels);
+  for (sampleno = 0; sampleno < samplebytes / 2; sampleno++)
+    put_16bit_le(samples[sampleno], p + sampleno * 2);
+
+  if (status == 0)
   {
-    fclose(outfile);
+    if (strcmp(filename, "-") == 0)
+      status = (fwrite(buf, 1, filesize, stdout) != filesize || 
+                fflush(stdout) != 0) ? 2 : 0;
+    else
+      status = write_file(AT_FDCWD, filename, buf, filesize);
+  }
+
+  free(buf);
+  return status;
+}
+
+
+// Create filename as a link to the sample in the sample store.
+// Samples are stored as <storedir>/<xx>/<fingerprint>.wav, where xx are
+// the first two digits of the fingerprint, a SHA-256 digest, so that a
+// stored sample with the same fingerprint has the same contents. A
+// sample is only decoded if it is not already in the store. It is
+// written to a temporary file which is then linked into place, so
+// several es12wav processes can share the same store.
+int store_sample(FILE *infile, int dirfd, char *filename,
+                 struct sampleinf *info)
+{
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  char hex[2 * SHA256_DIGEST_SIZE + 1];
+  char storename[PATH_MAX];
+  char tmpname[PATH_MAX];
+  int status;
+  int fd;
+  int i;
+
+  status = fingerprint(infile, info, digest);
+  if (status != 0)
     return status;
+  for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+    sprintf(hex + i * 2, "%02x", digest[i]);
+
+  snprintf(storename, sizeof storename, "%s/%.2s", storedir, hex);
+  if (mkdir(storename, 0777) < 0 && errno != EEXIST)
+    return 2;
+  snprintf(storename, sizeof storename, "%s/%.2s/%s.wav", storedir, hex,
+           hex);
+
+  if (access(storename, F_OK) == 0)
+  {
+    printf("Linking %s to stored sample %.16s\n", filename, hex);
+    __sync_fetch_and_add(&reused_samples, 1);
+  }
+  else
+  {
+    snprintf(tmpname, sizeof tmpname, "%s/%.2s/.tmpXXXXXX", storedir, hex);
+    fd = mkstemp(tmpname);
+    if (fd < 0)
+      return 2;
+    // mkstemp creates file as 0600; use the same mode as other outputs
+    fchmod(fd, 0666 & ~file_mask);
+    close(fd);
+    status = write_wavfile(infile, AT_FDCWD, tmpname, info);
+    // If another process stored it meanwhile, it is the same sample
+    if (status == 0 && link(tmpname, storename) < 0 && errno != EEXIST)
+      status = 2;
+    unlink(tmpname);
+    if (status != 0)
+      return status;
+    __sync_fetch_and_add(&stored_samples, 1);
   }
 
-  fclose(outfile);
+  // Hard link if possible, else symlink (e.g. store on other file system)
+  if (linkat(AT_FDCWD, storename, dirfd, filename, 0) < 0 &&
+      symlinkat(storename, dirfd, filename) < 0)
+    return 2;
   return 0;
 }
 
 
-int write_samples(FILE *infile, FILE *outfile, struct sampleinf *info)
+// Calculate fingerprint of sample, the SHA-256 digest of its compressed
+// data, without decoding it. Return 1 if read error, else 0.
+int fingerprint(FILE *infile, struct sampleinf *info, 
+                unsigned char *digest)
 {
-  long sampleunits_left;
-  int sampleunits;
-  int sampleno;
-  int bytes_read;
-  int status;
-  long where;
-  int stereo;
-  unsigned char inbuf[FRAMESIZE];  // input (compressed) frame mono/left
-  unsigned char inbufa[FRAMESIZE]; // input (compressed) frame right
-  short outbuf[FRAMESIZE];         // output samples mono/left
-  short outbufa[FRAMESIZE];        // output samples right
-
-
-  stereo = (info->sampleno >= MONO_SAMPLES);
-  sampleunits_left = info->lensamples / (stereo ? 2 : 1);
-
-  // Do this one frame at a time. Last frame will be complete,
-  // but may have fewer than FRAMESIZE samples
-  do
-  {
-    // ** Read data and uncompress **
-    sampleunits = (sampleunits_left > FRAMESIZE) ? FRAMESIZE : sampleunits_left;
-    where = ftell(infile);
-    bytes_read = fread(inbuf, 1, sizeof inbuf, infile);
-    if (bytes_read != FRAMESIZE)
+  unsigned char inbuf[FRAMESIZE];
+  unsigned char head[5];
+  struct sha256 ctx;
+  long frames;
+  long channels;
+  long bytes;
+  long i;
+
+  channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
+  frames = sample_frames(info);
+
+  // Decoded sample depends on channels and length as well as frames
+  head[0] = channels;
+  put_32bit_le(info->lensamples, head + 1);
+  sha256_init(&ctx);
+  sha256_update(&ctx, head, sizeof head);
+
+  // Left channel frames, then right (at +lenbytes), like write_samples()
+  for (bytes = 0; bytes < channels * info->lenbytes; bytes += info->lenbytes)
+  {
+    if (fseek(infile, info->startaddr + bytes, SEEK_SET) != 0)
       return 1;
-    uncompress(inbuf, outbuf);
-    if (stereo)
+    for (i = 0; i < frames; i++)
     {
-      fseek(infile, where + info->lenbytes, SEEK_SET);
-      fread(inbufa, 1, sizeof inbufa, infile);
-      uncompress(inbufa, outbufa);
-      status = fseek(infile, where+FRAMESIZE, SEEK_SET);
-      if (status != 0)
+      if (fread(inbuf, 1, sizeof inbuf, infile) != FRAMESIZE)
         return 1;
+      sha256_update(&ctx, inbuf, FRAMESIZE);
+    }
+  }
+
+  sha256_final(&ctx, digest);
+  return 0;
+}
+
+
+// Write all mono (stereo == 0) or stereo (stereo == 1) samples to one
+// file, one after the other, with a cue point and label for each.
+// All offsets are known from sampleinfo, so the file is written
+// sequentially, header first, then sample data.
+int write_combined(FILE *infile, int dirfd, char *filename, 
+                   struct sampleinf *sampleinfo, int no_of_samples, 
+                   int stereo)
+{
+  struct outputfile out;
+  unsigned char *header, *p;
+  unsigned char *samplebuf;
+  char label[16];
+  struct sampleinf *info;
+  long channels;
+  long samples;        // # samples (frames, in .wav terms) written so far
+  long samplebytes;
+  long headerlen;
+  long adtl_len;
+  int cues;
+  int waveno;
+  int status;
+
+  channels = stereo ? 2 : 1;
+
+  // Find size of data chunk and # of cue points
+  cues = 0;
+  samplebytes = 0;
+  for (waveno = 0; waveno < no_of_samples; waveno++)
+  {
+    info = &sampleinfo[waveno];
+    if ((info->sampleno >= MONO_SAMPLES) != stereo)
+      continue;
+    cues++;
+    samplebytes += info->lensamples * 2;
+  }
+  if (cues == 0)
+    return 0;
+
+  printf("Creating %s from %d samples\n", filename, cues);
+
+  adtl_len = 4 + cues * (LABL_SIZE + LTXT_SIZE);
+  headerlen = 12 + 24 + (12 + cues * CUEPOINT_SIZE) + (8 + adtl_len) + 8;
+  header = malloc(headerlen);
+  if (header == NULL)
+    return 2;
+
+  // .WAV header
+  p = header;
+  memcpy(p, "RIFF", 4); p += 4;
+  p = put_32bit_le(headerlen - 8 + samplebytes, p);
+  memcpy(p, "WAVE", 4); p += 4;
+
+  // fmt chunk
+  p = put_fmt_chunk(channels, p);
+
+  // cue chunk: one cue point at start of each sample
+  memcpy(p, "cue ", 4); p += 4;
+  p = put_32bit_le(4 + cues * CUEPOINT_SIZE, p);
+  p = put_32bit_le(cues, p);
+  samples = 0;
+  for (waveno = 0; waveno < no_of_samples; waveno++)
+  {
+    info = &sampleinfo[waveno];
+    if ((info->sampleno >= MONO_SAMPLES) != stereo)
+      continue;
+    p = put_32bit_le(info->sampleno + 1, p);  // cue point ID, must be != 0
+    p = put_32bit_le(samples, p);             // play order position
+    memcpy(p, "data", 4); p += 4;
+    p = put_32bit_le(0, p);                   // chunk start
+    p = put_32bit_le(0, p);                   // block start
+    p = put_32bit_le(samples, p);             // sample offset
+    samples += info->lensamples / channels;
+  }
+
+  // LIST adtl chunk: label and length of each sample
+  memcpy(p, "LIST", 4); p += 4;
+  p = put_32bit_le(adtl_len, p);
+  memcpy(p, "adtl", 4); p += 4;
+  for (waveno = 0; waveno < no_of_samples; waveno++)
+  {
+    info = &sampleinfo[waveno];
+    if ((info->sampleno >= MONO_SAMPLES) != stereo)
+      continue;
+    memset(label, 0, sizeof label);
+    sample_name(label, info->sampleno);
+    memcpy(p, "labl", 4); p += 4;
+    p = put_32bit_le(LABL_SIZE - 8, p);
+    p = put_32bit_le(info->sampleno + 1, p);
+    memcpy(p, label, 4); p += 4;              // "NN" or "NNs", 0-padded
+    memcpy(p, "ltxt", 4); p += 4;
+    p = put_32bit_le(LTXT_SIZE - 8, p);
+    p = put_32bit_le(info->sampleno + 1, p);
+    p = put_32bit_le(info->lensamples / channels, p);
+    memcpy(p, "rgn ", 4); p += 4;             // purpose
+    p = put_16bit_le(0, p);                   // country
+    p = put_16bit_le(0, p);                   // language
+    p = put_16bit_le(0, p);                   // dialect
+    p = put_16bit_le(0, p);                   // code page
+  }
+
+  // data chunk
+  memcpy(p, "data", 4); p += 4;
+  p = put_32bit_le(samplebytes, p);
+  assert(p - header == headerlen);
+
+  if (open_output(&out, dirfd, filename, headerlen + samplebytes) != 0)
+  {
+    free(header);
+    return 2;
+  }
+  status = append_output(&out, header, headerlen);
+  free(header);
+
+  // Uncompress and write each sample
+  for (waveno = 0; waveno < no_of_samples && status == 0; waveno++)
+  {
+    info = &sampleinfo[waveno];
+    if ((info->sampleno >= MONO_SAMPLES) != stereo)
+      continue;
+    samplebuf = malloc(info->lensamples * 2);
+    if (samplebuf == NULL)
+    {
+      status = 2;
+      break;
     }
-    // ** Write to file **
-    for (sampleno = 0; sampleno < sampleunits; sampleno++)
+    status = write_samples(infile, samplebuf, info);
+    if (status == 0)
+      status = append_output(&out, samplebuf, info->lensamples * 2);
+    free(samplebuf);
+  }
+
+  if (close_output(&out) != 0 && status == 0)
+    status = 2;
+  return status;
+}
+
+
+// Create file filename to be written with append_output(), preallocated
+// to filesize, using direct I/O if enabled (-d). Return 2 if failure,
+// else 0.
+int open_output(struct outputfile *out, int dirfd, char *filename, 
+                long filesize)
+{
+  out->block = NULL;
+  out->fill = 0;
+  out->pos = 0;
+  out->fd = open_direct(dirfd, filename, &out->direct);
+  if (out->fd < 0)
+    return 2;
+
+  // Preallocate; not all file systems support this, so ignore failure
+  if (filesize > 0)
+    fallocate(out->fd, 0, 0, filesize);
+  return 0;
+}
+
+
+// Add len bytes at data to output file, writing each block when full.
+// Whole DIRECT_ALIGN blocks at an aligned data are written from there
+// without copying. Return 2 if write error, else 0.
+int append_output(struct outputfile *out, unsigned char *data, long len)
+{
+  long count;
+
+  while (len > 0)
+  {
+    if (out->fill == 0 && len >= DIRECT_ALIGN && 
+        ((unsigned long) data & (DIRECT_ALIGN - 1)) == 0)
     {
-      status = write_16bit_le(outbuf[sampleno], outfile);
-      if (status != 0)
+      count = (len < WRITE_BLOCKSIZE) ? len : WRITE_BLOCKSIZE;
+      count &= ~(DIRECT_ALIGN - 1);
+      if (pwrite(out->fd, data, count, out->pos) != count)
         return 2;
-      if (stereo) 
-        write_16bit_le(outbufa[sampleno], outfile);
+      out->pos += count;
+      data += count;
+      len -= count;
+      continue;
     }
-    sampleunits_left -= sampleunits;
-  } while (sampleunits_left > 0);
 
+    if (out->block == NULL &&
+        posix_memalign((void **) &out->block, DIRECT_ALIGN, 
+                       WRITE_BLOCKSIZE) != 0)
+    {
+      out->block = NULL;
+      return 2;
+    }
+    count = WRITE_BLOCKSIZE - out->fill;
+    if (count > len)
+      count = len;
+    memcpy(out->block + out->fill, data, count);
+    out->fill += count;
+    data += count;
+    len -= count;
+    if (out->fill == WRITE_BLOCKSIZE)
+    {
+      if (pwrite(out->fd, out->block, WRITE_BLOCKSIZE, out->pos) != 
+          WRITE_BLOCKSIZE)
+        return 2;
+      out->pos += WRITE_BLOCKSIZE;
+      out->fill = 0;
+    }
+  }
   return 0;
 }
 
 
-// Write 32-bit little endian to file. Return 1 if failure, else 0.
-int write_32bit_le(long value, FILE *file)
+// Write last block of output file and close it. Return 2 if write
+// error, else 0.
+int close_output(struct outputfile *out)
+{
+  long blocksize;
+  int status = 0;
+
+  // O_DIRECT needs whole blocks; pad last one and truncate afterwards
+  blocksize = out->fill;
+  if (out->direct && blocksize > 0)
+  {
+    blocksize = (blocksize + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+    memset(out->block + out->fill, 0, blocksize - out->fill);
+  }
+  if (blocksize > 0 && 
+      pwrite(out->fd, out->block, blocksize, out->pos) != blocksize)
+    status = 2;
+  if (status == 0 && out->direct && 
+      ftruncate(out->fd, out->pos + out->fill) < 0)
+    status = 2;
+
+  if (close(out->fd) < 0)
+    status = 2;
+  free(out->block);
+  return status;
+}
+
+
+// Write buffer to new file with open_output() and friends. If buf is
+// aligned to DIRECT_ALIGN, it is written from there, copying only the
+// last partial block. Return 2 if failure, else 0.
+int write_file(int dirfd, char *filename, unsigned char *buf, long filesize)
 {
-  return fputc(value & 255, file) == EOF ||
-         fputc((value >> 8) & 255, file) == EOF ||
-         fputc((value >> 16) & 255, file) == EOF ||
-         fputc((value >> 24) & 255, file) == EOF;
+  struct outputfile out;
+  int status;
+
+  if (open_output(&out, dirfd, filename, filesize) != 0)
+    return 2;
+  status = append_output(&out, buf, filesize);
+  if (close_output(&out) != 0)
+    status = 2;
+  return status;
 }
 
-// Write 16-bit little endian to file. Return 1 if failure, else 0.
-int write_16bit_le(short value, FILE *file)
+
+// Create file filename for writing, with O_DIRECT if direct I/O is
+// enabled (-d) and the file system supports it, setting direct to
+// whether it is used. Return file descriptor, or -1 if error.
+int open_direct(int dirfd, char *filename, int *direct)
 {
-  return fputc(value & 255, file) == EOF || 
-         fputc((value >> 8) & 255, file) == EOF;
+  int fd;
+  int flags;
+
+  flags = O_WRONLY | O_CREAT | O_TRUNC;
+  *direct = direct_io;
+  fd = openat(dirfd, filename, flags | (*direct ? O_DIRECT : 0), 0666);
+  if (fd < 0 && *direct && errno == EINVAL)
+  {
+    // File system doesn't support O_DIRECT (e.g. tmpfs)
+    *direct = 0;
+    fd = openat(dirfd, filename, flags, 0666);
+  }
+  return fd;
 }
-      
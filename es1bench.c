@@ -0,0 +1,304 @@
+// ** es1bench.c - scaling benchmark for es12wav
+// ** Runs es12wav over corpora of 1..N images with 1..K conversions in
+// ** parallel, writing to tmpfs and to disk, and reports as CSV:
+// ** wall time, images/s, MB/s of PCM written, peak RSS of a single
+// ** conversion, and read/write system calls (from /proc/self/io,
+// ** which includes all reaped children).
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "adpcm.h"
+#include "es1.h"
+
+
+#define DEFAULT_MAXIMAGES (64)
+#define DEFAULT_TMPFSDIR "/dev/shm"
+#define DEFAULT_DISKDIR "."
+#define DEFAULT_CONVERTER "./es12wav"
+
+// I/O counters from /proc/self/io
+struct iocount
+{
+  long long syscr;
+  long long syscw;
+};
+
+
+// Prototypes
+int run(char *converter, char **images, long *pcmbytes, int no_of_images,
+        char *target, int corpus, int threads);
+int next_step(int n, int max);
+long pcm_bytes(char *filename);
+int read_iocount(struct iocount *io);
+int remove_entry(const char *path, const struct stat *st, int flag,
+                 struct FTW *ftw);
+double now(void);
+
+
+// Code
+
+int main(int argc, char **argv)
+{
+  char *converter = DEFAULT_CONVERTER;
+  char *targets[2];
+  char **images;
+  long *pcmbytes;
+  int no_of_images;
+  int maxcorpus = DEFAULT_MAXIMAGES;
+  int maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int corpus;
+  int threads;
+  int target;
+  int badopt = 0;
+  int opt;
+  int i;
+
+  targets[0] = DEFAULT_TMPFSDIR;
+  targets[1] = DEFAULT_DISKDIR;
+
+  while ((opt = getopt(argc, argv, "d:k:n:t:x:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'd': targets[1] = optarg; break;
+      case 'k': maxthreads = atoi(optarg); break;
+      case 'n': maxcorpus = atoi(optarg); break;
+      case 't': targets[0] = optarg; break;
+      case 'x': converter = optarg; break;
+      default: badopt = 1; break;
+    }
+  }
+
+  if (badopt || optind >= argc || maxcorpus < 1 || maxthreads < 1)
+  {
+    fprintf(stderr, "Usage: es1bench [-n <images>] [-k <threads>] "
+                    "[-t <tmpfsdir>] [-d <diskdir>] [-x <es12wav>] "
+                    "<es1file>...\n");
+    fprintf(stderr, "  -n  max corpus size, images are repeated to fill it "
+                    "(default %d)\n", DEFAULT_MAXIMAGES);
+    fprintf(stderr, "  -k  max parallel conversions (default # of CPUs)\n");
+    fprintf(stderr, "  -t  tmpfs output directory (default %s)\n",
+            DEFAULT_TMPFSDIR);
+    fprintf(stderr, "  -d  disk output directory (default %s)\n",
+            DEFAULT_DISKDIR);
+    fprintf(stderr, "  -x  converter to run (default %s)\n",
+            DEFAULT_CONVERTER);
+    exit(1);
+  }
+
+  images = argv + optind;
+  no_of_images = argc - optind;
+  pcmbytes = malloc(no_of_images * sizeof *pcmbytes);
+  if (pcmbytes == NULL)
+    exit(1);
+  for (i = 0; i < no_of_images; i++)
+  {
+    pcmbytes[i] = pcm_bytes(images[i]);
+    if (pcmbytes[i] < 0)
+    {
+      fprintf(stderr, "Can't read %s\n", images[i]);
+      exit(1);
+    }
+  }
+
+  printf("target,images,threads,wall_s,images_per_s,pcm_mb_per_s,"
+         "peak_rss_kb,read_syscalls,write_syscalls\n");
+
+  // Corpus sizes and thread counts double up to and including the max
+  for (target = 0; target < 2; target++)
+    for (corpus = 1; corpus > 0; corpus = next_step(corpus, maxcorpus))
+      for (threads = 1; threads > 0; threads = next_step(threads, maxthreads))
+      {
+        if (run(converter, images, pcmbytes, no_of_images, targets[target],
+                corpus, threads) != 0)
+          exit(1);
+      }
+
+  free(pcmbytes);
+  return 0;
+}
+
+
+// Convert corpus images (cycling through images) into new directories
+// under target, with at most threads conversions at a time. Print CSV
+// line with results. Return 1 if failure, else 0.
+int run(char *converter, char **images, long *pcmbytes, int no_of_images,
+        char *target, int corpus, int threads)
+{
+  char rundir[PATH_MAX];
+  char outdir[PATH_MAX + 16];
+  struct iocount io_before, io_after;
+  struct rusage usage;
+  double start, wall;
+  double pcm_total;
+  long peak_rss;
+  int running;
+  int started;
+  int status;
+  int failed;
+  int devnull;
+  pid_t pid;
+
+  snprintf(rundir, sizeof rundir, "%s/es1bench.%d", target, (int) getpid());
+  if (mkdir(rundir, 0777) < 0)
+  {
+    perror("Error creating output directory");
+    return 1;
+  }
+
+  read_iocount(&io_before);
+  start = now();
+  peak_rss = 0;
+  pcm_total = 0;
+  running = 0;
+  started = 0;
+  failed = 0;
+
+  while (started < corpus || running > 0)
+  {
+    if (started < corpus && running < threads)
+    {
+      snprintf(outdir, sizeof outdir, "%s/%d", rundir, started);
+      pid = fork();
+      if (pid == 0)
+      {
+        devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        execl(converter, converter, images[started % no_of_images],
+              outdir, (char *) NULL);
+        _exit(127);
+      }
+      if (pid < 0)
+      {
+        perror("Error starting converter");
+        failed = 1;
+        break;
+      }
+      pcm_total += pcmbytes[started % no_of_images];
+      started++;
+      running++;
+      continue;
+    }
+
+    pid = wait4(-1, &status, 0, &usage);
+    if (pid < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    running--;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      failed = 1;
+    if (usage.ru_maxrss > peak_rss)
+      peak_rss = usage.ru_maxrss;
+  }
+
+  wall = now() - start;
+  read_iocount(&io_after);
+
+  nftw(rundir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+  if (failed)
+  {
+    fprintf(stderr, "%s failed\n", converter);
+    return 1;
+  }
+
+  printf("%s,%d,%d,%.6f,%.2f,%.2f,%ld,%lld,%lld\n", target, corpus, threads,
+         wall, corpus / wall, pcm_total / 1e6 / wall, peak_rss,
+         io_after.syscr - io_before.syscr, io_after.syscw - io_before.syscw);
+  fflush(stdout);
+  return 0;
+}
+
+
+// Return n doubled, but no more than max, or 0 if n already is max
+int next_step(int n, int max)
+{
+  if (n >= max)
+    return 0;
+  return (n * 2 > max) ? max : n * 2;
+}
+
+
+// Return # bytes of PCM data es12wav writes for filename, or -1 if
+// it can't be read
+long pcm_bytes(char *filename)
+{
+  struct sampleinf sampleinfo[TOTAL_SAMPLES];
+  FILE *infile;
+  long total;
+  int no_of_samples;
+  int waveno;
+
+  infile = fopen(filename, "rb");
+  if (infile == NULL)
+    return -1;
+  if (check_signature(infile) != 0)
+  {
+    fclose(infile);
+    return -1;
+  }
+  no_of_samples = read_sampleheaders(infile, sampleinfo);
+  fclose(infile);
+  if (no_of_samples < 0)
+    return -1;
+
+  total = 0;
+  for (waveno = 0; waveno < no_of_samples; waveno++)
+    total += sampleinfo[waveno].lensamples * 2;
+  return total;
+}
+
+
+// Read system call counters for this process and its reaped children.
+// Return 1 if not available, else 0.
+int read_iocount(struct iocount *io)
+{
+  FILE *file;
+  char line[80];
+
+  io->syscr = io->syscw = 0;
+  file = fopen("/proc/self/io", "r");
+  if (file == NULL)
+    return 1;
+  while (fgets(line, sizeof line, file) != NULL)
+  {
+    sscanf(line, "syscr: %lld", &io->syscr);
+    sscanf(line, "syscw: %lld", &io->syscw);
+  }
+  fclose(file);
+  return 0;
+}
+
+
+// nftw() callback to remove output files and directories
+int remove_entry(const char *path, const struct stat *st, int flag,
+                 struct FTW *ftw)
+{
+  remove(path);
+  return 0;
+}
+
+
+// Monotonic time in seconds
+double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
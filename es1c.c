@@ -0,0 +1,210 @@
+// ** es1c.c - compact container of ES-1 compressed sample data
+// ** Keeps each sample's ADPCM frames as in the .es1 file, with an index
+// **
+// ** Samples are stored with the same layout as in the .es1 file, so the
+// ** sampleinfo read from the index can be used with decode_range() and
+// ** friends on the container file itself. Nothing is uncompressed until
+// ** a sample, or part of one, is asked for.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "adpcm.h"
+#include "es1.h"
+#include "es1c.h"
+
+
+// Copy sample data in blocks of this size
+#define COPY_BLOCKSIZE (65536)
+
+
+// Prototypes
+long get_32bit_le(unsigned char *buf);
+int get_16bit_le(unsigned char *buf);
+
+
+// Code
+
+// Return 1 if infile is a container, else 0. Leaves infile at start.
+int is_container(FILE *infile)
+{
+  char magic[4];
+  int found;
+
+  rewind(infile);
+  found = fread(magic, 1, 4, infile) == 4 && memcmp(magic, ES1C_MAGIC, 4) == 0;
+  rewind(infile);
+  return found;
+}
+
+
+// Read index of container infile into sampleinfo, with startaddr of
+// each sample pointing into infile. Each entry is range checked like
+// the sample headers of an .es1 file, and its frames must lie between
+// the index and the end of infile. Return # of samples, or -1 if not a
+// container or bad index.
+int read_container_index(FILE *infile, struct sampleinf *sampleinfo)
+{
+  unsigned char header[ES1C_HEADER_SIZE];
+  unsigned char entry[ES1C_ENTRY_SIZE];
+  char name[16];
+  struct sampleinf *info;
+  long filesize;
+  long channels;
+  int no_of_samples;
+  int waveno;
+
+  rewind(infile);
+  if (fread(header, 1, sizeof header, infile) != sizeof header ||
+      memcmp(header, ES1C_MAGIC, 4) != 0 ||
+      get_16bit_le(header + 4) != ES1C_VERSION)
+  {
+    fprintf(stderr, "Not an ES1C file!\n");
+    return -1;
+  }
+  no_of_samples = get_16bit_le(header + 6);
+  if (no_of_samples > TOTAL_SAMPLES)
+    return -1;
+  if (fseek(infile, 0, SEEK_END) != 0 || (filesize = ftell(infile)) < 0 ||
+      fseek(infile, ES1C_HEADER_SIZE, SEEK_SET) != 0)
+    return -1;
+
+  for (waveno = 0; waveno < no_of_samples; waveno++)
+  {
+    if (fread(entry, 1, sizeof entry, infile) != sizeof entry)
+      return -1;
+    info = &sampleinfo[waveno];
+    info->sampleno = get_16bit_le(entry);
+    info->status = get_16bit_le(entry + 2);
+    info->lensamples = get_32bit_le(entry + 8);
+    info->lenbytes = get_32bit_le(entry + 12);
+    info->startaddr = get_32bit_le(entry + 16);
+    if (info->sampleno < 0 || info->sampleno >= TOTAL_SAMPLES)
+      return -1;
+    channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
+    if (get_16bit_le(entry + 4) != channels || check_sampleinfo(info) != 0 ||
+        get_32bit_le(entry + 20) != sample_frames(info) ||
+        info->startaddr < ES1C_HEADER_SIZE + 
+                          (long) no_of_samples * ES1C_ENTRY_SIZE ||
+        info->startaddr + sample_databytes(info) > filesize)
+    {
+      sample_name(name, info->sampleno);
+      fprintf(stderr, "Bad index entry of sample %s\n", name);
+      return -1;
+    }
+  }
+
+  return no_of_samples;
+}
+
+
+// Read sample headers of infile, either an ES-1 file or a container.
+// Return # of samples, or -1 if neither or read error.
+int read_sampleindex(FILE *infile, struct sampleinf *sampleinfo)
+{
+  if (is_container(infile))
+    return read_container_index(infile, sampleinfo);
+  if (check_signature(infile) != 0)
+    return -1;
+  return read_sampleheaders(infile, sampleinfo);
+}
+
+
+// Write all samples of ES-1 file infile to container filename.
+// Return 1 if read error or bad format, 2 if write error, else 0.
+int write_container(FILE *infile, char *filename)
+{
+  struct sampleinf sampleinfo[TOTAL_SAMPLES];
+  unsigned char header[ES1C_HEADER_SIZE];
+  unsigned char entry[ES1C_ENTRY_SIZE];
+  unsigned char *buf, *p;
+  struct sampleinf *info;
+  FILE *outfile;
+  long offset;
+  long databytes;
+  long bytes;
+  long channels;
+  int no_of_samples;
+  int waveno;
+  int status;
+
+  if (check_signature(infile) != 0)
+    return 1;
+  no_of_samples = read_sampleheaders(infile, sampleinfo);
+  if (no_of_samples < 0)
+    return 1;
+
+  buf = malloc(COPY_BLOCKSIZE);
+  if (buf == NULL)
+    return 2;
+  outfile = fopen(filename, "wb");
+  if (outfile == NULL)
+  {
+    free(buf);
+    return 2;
+  }
+
+  memcpy(header, ES1C_MAGIC, 4);
+  p = put_16bit_le(ES1C_VERSION, header + 4);
+  p = put_16bit_le(no_of_samples, p);
+  p = put_32bit_le(ES1_SAMPLERATE, p);
+  put_32bit_le(0, p);
+  status = fwrite(header, 1, sizeof header, outfile) != sizeof header;
+
+  // Index, with data following it in sample order
+  offset = ES1C_HEADER_SIZE + no_of_samples * ES1C_ENTRY_SIZE;
+  for (waveno = 0; status == 0 && waveno < no_of_samples; waveno++)
+  {
+    info = &sampleinfo[waveno];
+    channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
+    p = put_16bit_le(info->sampleno, entry);
+    p = put_16bit_le(info->status, p);
+    p = put_16bit_le(channels, p);
+    p = put_16bit_le(0, p);
+    p = put_32bit_le(info->lensamples, p);
+    p = put_32bit_le(info->lenbytes, p);
+    p = put_32bit_le(offset, p);
+    put_32bit_le(sample_frames(info), p);
+    status = fwrite(entry, 1, sizeof entry, outfile) != sizeof entry;
+    offset += sample_databytes(info);
+  }
+  if (status != 0)
+    status = 2;
+
+  // Frames, verbatim
+  for (waveno = 0; status == 0 && waveno < no_of_samples; waveno++)
+  {
+    info = &sampleinfo[waveno];
+    if (fseek(infile, info->startaddr, SEEK_SET) != 0)
+      status = 1;
+    for (databytes = sample_databytes(info); status == 0 && databytes > 0;
+         databytes -= bytes)
+    {
+      bytes = (databytes < COPY_BLOCKSIZE) ? databytes : COPY_BLOCKSIZE;
+      if ((long) fread(buf, 1, bytes, infile) != bytes)
+        status = 1;
+      else if ((long) fwrite(buf, 1, bytes, outfile) != bytes)
+        status = 2;
+    }
+  }
+
+  if (fclose(outfile) != 0 && status == 0)
+    status = 2;
+  free(buf);
+  if (status != 0)
+    remove(filename);
+  return status;
+}
+
+
+
+long get_32bit_le(unsigned char *buf)
+{
+  return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((long) buf[3] << 24);
+}
+
+
+int get_16bit_le(unsigned char *buf)
+{
+  return buf[0] | (buf[1] << 8);
+}
@@ -0,0 +1,19 @@
+// ** es1c.h - compact container of ES-1 compressed sample data
+// ** Keeps each sample's ADPCM frames as in the .es1 file, with an index
+
+// Container layout, all values little endian:
+// header: "ES1C", version (16), # samples (16), sample rate (32), 0 (32)
+// one index entry per sample: sampleno (16), status (16), channels (16),
+//   0 (16), lensamples (32), lenbytes (32), data offset (32),
+//   frames per channel (32)
+// sample data: the frames of each sample, copied from the .es1 file,
+// right channel lenbytes after left as there
+#define ES1C_MAGIC "ES1C"
+#define ES1C_VERSION (1)
+#define ES1C_HEADER_SIZE (16)
+#define ES1C_ENTRY_SIZE (24)
+
+int is_container(FILE *infile);
+int read_container_index(FILE *infile, struct sampleinf *sampleinfo);
+int read_sampleindex(FILE *infile, struct sampleinf *sampleinfo);
+int write_container(FILE *infile, char *filename);
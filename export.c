@@ -0,0 +1,180 @@
+// ** export.c - processing of uncompressed samples before writing
+// ** Silence trimming, peak or RMS normalization, TPDF dither
+// **
+// ** Samples are processed in the buffer they were uncompressed to, so
+// ** that output files can be written once, with sizes from the trimmed
+// ** length.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "export.h"
+
+
+// Full scale for dBFS levels
+#define FULL_SCALE (32767.0)
+
+
+// Prototypes
+double db_to_amplitude(double db);
+double tpdf(unsigned long *seed);
+
+
+// Code
+
+// Return 1 if opts change the samples at all, else 0
+int export_active(struct exportopts *opts)
+{
+  return opts->trim || opts->normalization != NORMALIZE_NONE;
+}
+
+
+// Parse normalization spec "peak[:<dBFS>]" or "rms[:<dBFS>]" into opts.
+// Return 1 if bad spec, else 0.
+int parse_normalization(char *spec, struct exportopts *opts)
+{
+  char *end;
+  size_t len;
+
+  len = strcspn(spec, ":");
+  if (len == 4 && strncmp(spec, "peak", 4) == 0)
+  {
+    opts->normalization = NORMALIZE_PEAK;
+    opts->level = DEFAULT_PEAK_LEVEL;
+  }
+  else if (len == 3 && strncmp(spec, "rms", 3) == 0)
+  {
+    opts->normalization = NORMALIZE_RMS;
+    opts->level = DEFAULT_RMS_LEVEL;
+  }
+  else
+    return 1;
+
+  if (spec[len] == ':')
+  {
+    opts->level = strtod(spec + len + 1, &end);
+    if (end == spec + len + 1 || *end != '\0' || opts->level > 0.0)
+      return 1;
+  }
+  return 0;
+}
+
+
+// Parse silence trimming level "<dBFS>" into opts.
+// Return 1 if bad level, else 0.
+int parse_trim_level(char *spec, struct exportopts *opts)
+{
+  char *end;
+
+  opts->trim = 1;
+  opts->trim_level = strtod(spec, &end);
+  if (end == spec || *end != '\0' || opts->trim_level > 0.0)
+    return 1;
+  return 0;
+}
+
+
+// Trim and normalize length samples per channel in samples (channels
+// interleaved), as given by opts. The remaining samples are moved to
+// the start of samples. seed makes the dither of each sample
+// repeatable. Return new length per channel.
+long process_samples(short *samples, long length, int channels,
+                     struct exportopts *opts, unsigned long seed)
+{
+  long first, last;
+  long threshold;
+  long count;
+  long i;
+  double peak;
+  double sum;
+  double gain;
+  double value;
+
+  count = length * channels;
+
+  // Trim to first..last-1 whole sample frames (all channels) above
+  // threshold
+  first = 0;
+  last = count;
+  if (opts->trim)
+  {
+    threshold = (long) db_to_amplitude(opts->trim_level);
+    while (first < count && labs(samples[first]) <= threshold)
+      first++;
+    while (last > first && labs(samples[last - 1]) <= threshold)
+      last--;
+    first -= first % channels;
+    last += (channels - last % channels) % channels;
+  }
+  if (first > 0)
+    memmove(samples, samples + first, (last - first) * sizeof *samples);
+  count = last - first;
+
+  if (opts->normalization == NORMALIZE_NONE || count == 0)
+    return count / channels;
+
+  peak = 0.0;
+  sum = 0.0;
+  for (i = 0; i < count; i++)
+  {
+    value = samples[i];
+    if (fabs(value) > peak)
+      peak = fabs(value);
+    sum += value * value;
+  }
+  if (opts->normalization == NORMALIZE_PEAK)
+    gain = (peak > 0.0) ? db_to_amplitude(opts->level) / peak : 1.0;
+  else
+    gain = (sum > 0.0) ? 
+           db_to_amplitude(opts->level) / sqrt(sum / count) : 1.0;
+
+  // At unity gain the samples are unchanged, so there is nothing to dither
+  if (gain == 1.0)
+    return count / channels;
+
+  for (i = 0; i < count; i++)
+  {
+    value = samples[i] * gain;
+    if (opts->dither)
+      value += tpdf(&seed);
+    value = floor(value + 0.5);
+    if (value > 32767.0)
+      value = 32767.0;
+    if (value < -32768.0)
+      value = -32768.0;
+    samples[i] = (short) value;
+  }
+  return count / channels;
+}
+
+
+// Convert dBFS level to amplitude
+double db_to_amplitude(double db)
+{
+  return FULL_SCALE * pow(10.0, db / 20.0);
+}
+
+
+// Triangular dither, -1..1 LSB, as the sum of two uniform -0.5..0.5
+// values from a 32 bit xorshift generator
+double tpdf(unsigned long *seed)
+{
+  double sum;
+  unsigned long x;
+  int i;
+
+  sum = 0.0;
+  for (i = 0; i < 2; i++)
+  {
+    x = *seed & 0xffffffffUL;
+    if (x == 0)
+      x = 1;
+    x ^= (x << 13) & 0xffffffffUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xffffffffUL;
+    *seed = x;
+    sum += x / 4294967296.0 - 0.5;
+  }
+  return sum;
+}
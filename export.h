@@ -0,0 +1,28 @@
+// ** export.h - processing of uncompressed samples before writing
+// ** Silence trimming, peak or RMS normalization, TPDF dither
+
+enum normalization
+{
+  NORMALIZE_NONE,
+  NORMALIZE_PEAK,
+  NORMALIZE_RMS
+};
+
+// Default normalization levels (dBFS)
+#define DEFAULT_PEAK_LEVEL (0.0)
+#define DEFAULT_RMS_LEVEL (-20.0)
+
+struct exportopts
+{
+  int trim;                     // trim leading and trailing silence
+  double trim_level;            // silence is at or below this (dBFS)
+  int normalization;            // enum normalization
+  double level;                 // normalize to this (dBFS)
+  int dither;                   // add TPDF dither when normalizing
+};
+
+int export_active(struct exportopts *opts);
+int parse_normalization(char *spec, struct exportopts *opts);
+int parse_trim_level(char *spec, struct exportopts *opts);
+long process_samples(short *samples, long length, int channels,
+                     struct exportopts *opts, unsigned long seed);
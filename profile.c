@@ -0,0 +1,245 @@
+// ** profile.c - decoder profile histograms as JSON
+// ** Profiles are added to an existing file, so runs over a corpus merge
+// **
+// ** The file is a JSON object with one member per counter, each a
+// ** number or an array of numbers. Files from separate runs can also be
+// ** merged by adding members element by element. "runs" counts the
+// ** profiles added up in a file. The file is locked while it is read
+// ** and rewritten, so parallel conversions can profile into one file.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "adpcm.h"
+#include "profile.h"
+
+
+// Counters of struct decoderprofile, in file order
+struct profilefield
+{
+  char *name;
+  size_t offset;
+  int count;
+};
+
+#define FIELD(member, name) \
+  { name, offsetof(struct decoderprofile, member), \
+    sizeof ((struct decoderprofile *) 0)->member / sizeof (unsigned long) }
+
+struct profilefield profilefields[] =
+{
+  FIELD(frames, "frames"),
+  FIELD(constant_frames, "constant_frames"),
+  FIELD(tableno, "tableno"),
+  FIELD(valcase, "valcase"),
+  FIELD(update_clamps, "update_clamps"),
+  FIELD(newstep_bounds, "newstep_bounds"),
+  FIELD(deltas, "deltas"),
+};
+#define PROFILEFIELDS (sizeof profilefields / sizeof profilefields[0])
+
+// Largest profile file read back
+#define MAX_PROFILESIZE (65536)
+
+
+// Prototypes
+int lock_profile(char *filename, struct stat *st);
+int read_profile(char *filename, struct decoderprofile *profile,
+                 unsigned long *runs);
+int parse_numbers(char *text, char *name, unsigned long *values, int count);
+
+
+// Code
+
+// Add profile to the counters in JSON file filename, creating it if
+// it does not exist. Return 1 if existing file is bad, 2 if write
+// error, else 0.
+int write_profile(char *filename, struct decoderprofile *profile)
+{
+  struct decoderprofile total;
+  struct stat st;
+  unsigned long *values, *added;
+  unsigned long runs;
+  char tmpname[PATH_MAX];
+  FILE *outfile;
+  unsigned int fieldno;
+  int lockfd;
+  int tmpfd;
+  int i;
+
+  lockfd = lock_profile(filename, &st);
+  if (lockfd < 0)
+    return 2;
+
+  memset(&total, 0, sizeof total);
+  runs = 0;
+  if (read_profile(filename, &total, &runs) != 0)
+  {
+    fprintf(stderr, "Bad profile file %s\n", filename);
+    close(lockfd);
+    return 1;
+  }
+  runs++;
+
+  // Write new file and rename it over the old one, so the old one is
+  // kept if anything goes wrong
+  snprintf(tmpname, sizeof tmpname, "%s.XXXXXX", filename);
+  tmpfd = mkstemp(tmpname);
+  outfile = NULL;
+  if (tmpfd >= 0)
+  {
+    fchmod(tmpfd, st.st_mode & 0777);
+    outfile = fdopen(tmpfd, "w");
+    if (outfile == NULL)
+    {
+      close(tmpfd);
+      remove(tmpname);
+    }
+  }
+  if (outfile == NULL)
+  {
+    close(lockfd);
+    return 2;
+  }
+
+  fprintf(outfile, "{\n  \"runs\": %lu", runs);
+  for (fieldno = 0; fieldno < PROFILEFIELDS; fieldno++)
+  {
+    values = (unsigned long *) ((char *) &total + 
+                                profilefields[fieldno].offset);
+    added = (unsigned long *) ((char *) profile + 
+                               profilefields[fieldno].offset);
+    fprintf(outfile, ",\n  \"%s\": ", profilefields[fieldno].name);
+    if (profilefields[fieldno].count == 1)
+    {
+      fprintf(outfile, "%lu", values[0] + added[0]);
+      continue;
+    }
+    fprintf(outfile, "[");
+    for (i = 0; i < profilefields[fieldno].count; i++)
+      fprintf(outfile, "%s%lu", i ? ", " : "", values[i] + added[i]);
+    fprintf(outfile, "]");
+  }
+  fprintf(outfile, "\n}\n");
+
+  if (fclose(outfile) != 0 || rename(tmpname, filename) != 0)
+  {
+    remove(tmpname);
+    close(lockfd);
+    return 2;
+  }
+  close(lockfd);
+  return 0;
+}
+
+
+// Open file filename, creating it if it does not exist, and lock it.
+// As a writer holding the lock renames a new file over it, retry until
+// the file locked is the one filename still refers to. Set st to its
+// status. Return locked file descriptor, or -1 if error.
+int lock_profile(char *filename, struct stat *st)
+{
+  struct stat namest;
+  int fd;
+
+  for (;;)
+  {
+    fd = open(filename, O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+      return -1;
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, st) != 0)
+    {
+      close(fd);
+      return -1;
+    }
+    if (stat(filename, &namest) == 0 && namest.st_dev == st->st_dev &&
+        namest.st_ino == st->st_ino)
+      return fd;
+    close(fd);
+  }
+}
+
+
+// Read counters from JSON file filename into profile and runs, leaving
+// them as they are if the file does not exist or is empty. Return 1 if
+// file can't be read or a counter is missing, else 0.
+int read_profile(char *filename, struct decoderprofile *profile,
+                 unsigned long *runs)
+{
+  FILE *infile;
+  char *text;
+  size_t size;
+  unsigned int fieldno;
+  int status;
+
+  infile = fopen(filename, "r");
+  if (infile == NULL)
+    return 0;
+  text = malloc(MAX_PROFILESIZE + 1);
+  if (text == NULL)
+  {
+    fclose(infile);
+    return 1;
+  }
+  size = fread(text, 1, MAX_PROFILESIZE, infile);
+  status = ferror(infile) || size == MAX_PROFILESIZE;
+  fclose(infile);
+  text[size] = '\0';
+  if (status == 0 && size == 0)
+  {
+    free(text);
+    return 0;
+  }
+
+  if (status == 0)
+    status = parse_numbers(text, "runs", runs, 1);
+  for (fieldno = 0; status == 0 && fieldno < PROFILEFIELDS; fieldno++)
+    status = parse_numbers(text, profilefields[fieldno].name,
+                           (unsigned long *) ((char *) profile +
+                                              profilefields[fieldno].offset),
+                           profilefields[fieldno].count);
+  free(text);
+  return status;
+}
+
+
+// Find member "name" in JSON text and parse its value into values, a
+// number if count is 1, else an array of count numbers. Return 1 if
+// not found or bad format, else 0.
+int parse_numbers(char *text, char *name, unsigned long *values, int count)
+{
+  char key[64];
+  char *p, *end;
+  int i;
+
+  snprintf(key, sizeof key, "\"%s\"", name);
+  p = strstr(text, key);
+  if (p == NULL)
+    return 1;
+  p += strlen(key);
+  p += strspn(p, " \t\r\n");
+  if (*p++ != ':')
+    return 1;
+  p += strspn(p, " \t\r\n");
+
+  if (count > 1 && *p++ != '[')
+    return 1;
+  for (i = 0; i < count; i++)
+  {
+    values[i] = strtoul(p, &end, 10);
+    if (end == p)
+      return 1;
+    p = end + strspn(end, " \t\r\n");
+    if (i < count - 1 && *p++ != ',')
+      return 1;
+  }
+  if (count > 1 && *p != ']')
+    return 1;
+  return 0;
+}
@@ -0,0 +1,4 @@
+// ** profile.h - decoder profile histograms as JSON
+// ** Profiles are added to an existing file, so runs over a corpus merge
+
+int write_profile(char *filename, struct decoderprofile *profile);
@@ -0,0 +1,417 @@
+// ** pyes1.c - Python extension module for reading ES-1 files
+// ** Uncompresses samples directly into caller supplied int16 buffers
+// **
+// ** >>> import es1, array
+// ** >>> image = es1.Image("dump.es1")
+// ** >>> s = image.samples[0]
+// ** >>> buf = array.array("h", bytes(2 * s["length"] * s["channels"]))
+// ** >>> image.decode(s["sampleno"], buf)
+// **
+// ** Any writable buffer with int16 items can be used, e.g. a numpy
+// ** array of dtype int16. Stereo samples are interleaved, unless
+// ** planar=True is given, in which case all left channel samples come
+// ** first, then all right. The GIL is released while uncompressing.
+// ** Compact containers written by es12wav -a can be read as well.
+
+#define _GNU_SOURCE
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "adpcm.h"
+#include "es1.h"
+#include "es1c.h"
+
+
+// es1.Image object: whole .es1 file in memory, plus its sample headers
+typedef struct
+{
+  PyObject_HEAD
+  unsigned char *data;
+  long size;
+  int no_of_samples;
+  struct sampleinf sampleinfo[TOTAL_SAMPLES];
+} Image;
+
+
+// Prototypes
+static int Image_init(Image *self, PyObject *args, PyObject *kwds);
+static void Image_dealloc(Image *self);
+static PyObject *Image_samples(Image *self, void *closure);
+static PyObject *Image_decode(Image *self, PyObject *args, PyObject *kwds);
+static PyObject *Image_envelope(Image *self, PyObject *args);
+static struct sampleinf *find_sample(Image *self, PyObject *sample);
+
+
+static PyGetSetDef Image_getset[] =
+{
+  {"samples", (getter) Image_samples, NULL,
+   "List of dicts describing each sample in the file", NULL},
+  {NULL}
+};
+
+static PyMethodDef Image_methods[] =
+{
+  {"decode", (PyCFunction) Image_decode, METH_VARARGS | METH_KEYWORDS,
+   "decode(sample, out, planar=False, start=0, end=None)"
+   " -> samples per channel\n\n"
+   "Uncompress sample (sampleno or name like '07' or '12s') into the\n"
+   "writable int16 buffer out. Only samples start..end-1 of each\n"
+   "channel are uncompressed, reading just the frames that cover them."},
+  {"envelope", (PyCFunction) Image_envelope, METH_VARARGS,
+   "envelope(sample) -> [[(min, max), ...], ...]\n\n"
+   "Coarse envelope of sample, one (min, max) per frame of 32 samples,\n"
+   "for each channel. Only the frame headers are read, nothing is\n"
+   "uncompressed."},
+  {NULL}
+};
+
+static PyTypeObject ImageType =
+{
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "es1.Image",
+  .tp_doc = "Image(filename): Korg ES-1 file or ES1C container",
+  .tp_basicsize = sizeof (Image),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_new = PyType_GenericNew,
+  .tp_init = (initproc) Image_init,
+  .tp_dealloc = (destructor) Image_dealloc,
+  .tp_methods = Image_methods,
+  .tp_getset = Image_getset,
+};
+
+static struct PyModuleDef es1module =
+{
+  PyModuleDef_HEAD_INIT,
+  .m_name = "es1",
+  .m_doc = "Korg ES-1 sample file reader",
+  .m_size = -1,
+};
+
+
+// Code
+
+PyMODINIT_FUNC PyInit_es1(void)
+{
+  PyObject *module;
+
+  if (PyType_Ready(&ImageType) < 0)
+    return NULL;
+
+  module = PyModule_Create(&es1module);
+  if (module == NULL)
+    return NULL;
+
+  Py_INCREF(&ImageType);
+  if (PyModule_AddObject(module, "Image", (PyObject *) &ImageType) < 0)
+  {
+    Py_DECREF(&ImageType);
+    Py_DECREF(module);
+    return NULL;
+  }
+
+  PyModule_AddIntConstant(module, "MONO_SAMPLES", MONO_SAMPLES);
+  PyModule_AddIntConstant(module, "STEREO_SAMPLES", STEREO_SAMPLES);
+  PyModule_AddIntConstant(module, "SAMPLERATE", ES1_SAMPLERATE);
+  return module;
+}
+
+
+// Read file into memory and parse its sample headers. An Image is only
+// initialised once: decode() uses self->data without the GIL, so it
+// can't be replaced under another thread.
+static int Image_init(Image *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"filename", NULL};
+  PyObject *filename;
+  FILE *infile;
+  int status;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&", kwlist,
+                                   PyUnicode_FSConverter, &filename))
+    return -1;
+  if (self->data != NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Image already initialised");
+    Py_DECREF(filename);
+    return -1;
+  }
+
+  infile = fopen(PyBytes_AS_STRING(filename), "rb");
+  if (infile == NULL)
+  {
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filename);
+    Py_DECREF(filename);
+    return -1;
+  }
+  Py_DECREF(filename);
+
+  fseek(infile, 0, SEEK_END);
+  self->size = ftell(infile);
+  rewind(infile);
+  self->data = malloc(self->size > 0 ? self->size : 1);
+  if (self->data == NULL)
+  {
+    fclose(infile);
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  status = (long) fread(self->data, 1, self->size, infile) != self->size;
+  if (status == 0)
+  {
+    self->no_of_samples = read_sampleindex(infile, self->sampleinfo);
+    status = self->no_of_samples < 0;
+  }
+  fclose(infile);
+
+  if (status != 0)
+  {
+    free(self->data);
+    self->data = NULL;
+    self->no_of_samples = 0;
+    PyErr_SetString(PyExc_ValueError, "not an ES1 or ES1C file");
+    return -1;
+  }
+  return 0;
+}
+
+
+static void Image_dealloc(Image *self)
+{
+  free(self->data);
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+
+// Image.samples: list of dicts, one per sample
+static PyObject *Image_samples(Image *self, void *closure)
+{
+  struct sampleinf *info;
+  PyObject *list;
+  PyObject *dict;
+  char name[16];
+  int channels;
+  int waveno;
+
+  list = PyList_New(self->no_of_samples);
+  if (list == NULL)
+    return NULL;
+
+  for (waveno = 0; waveno < self->no_of_samples; waveno++)
+  {
+    info = &self->sampleinfo[waveno];
+    channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
+    sample_name(name, info->sampleno);
+    dict = Py_BuildValue("{s:i,s:s,s:i,s:i,s:l,s:l,s:l}",
+                         "sampleno", info->sampleno,
+                         "name", name,
+                         "status", info->status,
+                         "channels", channels,
+                         "length", info->lensamples / channels,
+                         "lenbytes", info->lenbytes,
+                         "startaddr", info->startaddr);
+    if (dict == NULL)
+    {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, waveno, dict);
+  }
+
+  return list;
+}
+
+
+// Image.decode(sample, out, planar=False, start=0, end=None)
+static PyObject *Image_decode(Image *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"sample", "out", "planar", "start", "end", NULL};
+  struct sampleinf *info;
+  PyObject *sample;
+  Py_buffer view;
+  FILE *infile;
+  short *left, *right;
+  long stride;
+  long length;
+  long channels;
+  long start = 0;
+  long end = -1;
+  int planar = 0;
+  int status;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "Ow*|pll", kwlist,
+                                   &sample, &view, &planar, &start, &end))
+    return NULL;
+
+  info = find_sample(self, sample);
+  if (info == NULL)
+  {
+    PyBuffer_Release(&view);
+    return NULL;
+  }
+
+  channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
+  if (end < 0)
+    end = info->lensamples / channels;
+  if (start < 0 || start > end || end > info->lensamples / channels)
+  {
+    PyBuffer_Release(&view);
+    PyErr_SetString(PyExc_IndexError, "bad sample range");
+    return NULL;
+  }
+  length = end - start;
+  if (view.itemsize != 2 ||
+      (view.format != NULL && strcmp(view.format, "h") != 0 &&
+       strcmp(view.format, "<h") != 0 && strcmp(view.format, "=h") != 0) ||
+      !PyBuffer_IsContiguous(&view, 'C'))
+  {
+    PyBuffer_Release(&view);
+    PyErr_SetString(PyExc_TypeError,
+                    "out must be a contiguous int16 buffer");
+    return NULL;
+  }
+  if (view.len < length * channels * 2)
+  {
+    PyBuffer_Release(&view);
+    PyErr_Format(PyExc_ValueError, "out too small, need %ld items",
+                 length * channels);
+    return NULL;
+  }
+
+  left = view.buf;
+  if (planar)
+  {
+    right = left + length;
+    stride = 1;
+  }
+  else
+  {
+    right = left + 1;
+    stride = channels;
+  }
+
+  // Each call uncompresses from its own stream over the file data,
+  // so several threads can decode from the same image concurrently
+  Py_BEGIN_ALLOW_THREADS
+  infile = fmemopen(self->data, self->size, "rb");
+  status = 1;
+  if (infile != NULL)
+  {
+    status = decode_range(infile, info, start, end, left, right, stride);
+    fclose(infile);
+  }
+  Py_END_ALLOW_THREADS
+
+  PyBuffer_Release(&view);
+  if (status != 0)
+  {
+    PyErr_SetString(PyExc_ValueError, "error reading sample data");
+    return NULL;
+  }
+  return PyLong_FromLong(length);
+}
+
+
+// Image.envelope(sample)
+static PyObject *Image_envelope(Image *self, PyObject *args)
+{
+  struct sampleinf *info;
+  PyObject *sample;
+  PyObject *channels_list;
+  PyObject *list;
+  PyObject *pair;
+  FILE *infile;
+  short *minval, *maxval;
+  long frames_per_channel;
+  long frameno;
+  long channels;
+  long i;
+  int channel;
+  int status;
+
+  if (!PyArg_ParseTuple(args, "O", &sample))
+    return NULL;
+  info = find_sample(self, sample);
+  if (info == NULL)
+    return NULL;
+
+  channels = (info->sampleno >= MONO_SAMPLES) ? 2 : 1;
+  frames_per_channel = sample_frames(info);
+  minval = malloc((channels * frames_per_channel + 1) * sizeof *minval);
+  maxval = malloc((channels * frames_per_channel + 1) * sizeof *maxval);
+  status = 1;
+  if (minval != NULL && maxval != NULL)
+  {
+    infile = fmemopen(self->data, self->size, "rb");
+    if (infile != NULL)
+    {
+      status = sample_envelope(infile, info, minval, maxval);
+      fclose(infile);
+    }
+  }
+  if (status != 0)
+  {
+    free(minval);
+    free(maxval);
+    PyErr_SetString(PyExc_ValueError, "error reading sample data");
+    return NULL;
+  }
+
+  channels_list = PyList_New(channels);
+  for (channel = 0; channels_list != NULL && channel < channels; channel++)
+  {
+    list = PyList_New(frames_per_channel);
+    for (frameno = 0; list != NULL && frameno < frames_per_channel;
+         frameno++)
+    {
+      i = channel * frames_per_channel + frameno;
+      pair = Py_BuildValue("(ii)", minval[i], maxval[i]);
+      if (pair == NULL)
+        Py_CLEAR(list);
+      else
+        PyList_SET_ITEM(list, frameno, pair);
+    }
+    if (list == NULL)
+      Py_CLEAR(channels_list);
+    else
+      PyList_SET_ITEM(channels_list, channel, list);
+  }
+
+  free(minval);
+  free(maxval);
+  return channels_list;
+}
+
+
+// Find sample given as sampleno or name. Set exception if not found.
+static struct sampleinf *find_sample(Image *self, PyObject *sample)
+{
+  const char *name;
+  long sampleno;
+  int waveno;
+
+  if (PyUnicode_Check(sample))
+  {
+    name = PyUnicode_AsUTF8(sample);
+    if (name == NULL)
+      return NULL;
+    sampleno = parse_sample_name((char *) name);
+  }
+  else
+  {
+    sampleno = PyLong_AsLong(sample);
+    if (sampleno == -1 && PyErr_Occurred())
+      return NULL;
+  }
+
+  for (waveno = 0; waveno < self->no_of_samples; waveno++)
+  {
+    if (self->sampleinfo[waveno].sampleno == sampleno)
+      return &self->sampleinfo[waveno];
+  }
+
+  PyErr_SetString(PyExc_KeyError, "no such sample");
+  return NULL;
+}
@@ -0,0 +1,14 @@
+# setup.py - build the es1 Python extension module
+# python3 setup.py build_ext --inplace
+
+from setuptools import setup, Extension
+
+setup(
+    name="es1",
+    version="1.9",
+    description="Korg ES-1 sample file reader",
+    ext_modules=[
+        Extension("es1", sources=["pyes1.c", "es1.c", "es1c.c", "adpcm.c"],
+                  include_dirs=["."]),
+    ],
+)
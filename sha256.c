@@ -0,0 +1,160 @@
+// ** sha256.c - SHA-256 message digest (FIPS 180-4)
+// ** Used for sample store fingerprints
+// **
+// ** 32 bit words are kept in unsigned long, masked after each addition
+// ** or left shift, so no fixed width types are needed.
+
+#include <string.h>
+#include "sha256.h"
+
+
+#define MASK32 (0xffffffffUL)
+#define ROTR(x, n) ((((x) >> (n)) | ((x) << (32 - (n)))) & MASK32)
+
+static const unsigned long sha256_k[64] =
+{
+  0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL,
+  0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+  0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL,
+  0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+  0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL,
+  0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+  0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL,
+  0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+  0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL,
+  0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+  0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL,
+  0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+  0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL,
+  0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+  0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL,
+  0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+
+// Prototypes
+void sha256_block(struct sha256 *ctx, const unsigned char *block);
+
+
+// Code
+
+void sha256_init(struct sha256 *ctx)
+{
+  ctx->state[0] = 0x6a09e667UL;
+  ctx->state[1] = 0xbb67ae85UL;
+  ctx->state[2] = 0x3c6ef372UL;
+  ctx->state[3] = 0xa54ff53aUL;
+  ctx->state[4] = 0x510e527fUL;
+  ctx->state[5] = 0x9b05688cUL;
+  ctx->state[6] = 0x1f83d9abUL;
+  ctx->state[7] = 0x5be0cd19UL;
+  ctx->length = 0;
+  ctx->fill = 0;
+}
+
+
+// Add len bytes at data to digest
+void sha256_update(struct sha256 *ctx, const unsigned char *data, long len)
+{
+  long count;
+
+  ctx->length += len;
+  while (len > 0)
+  {
+    count = SHA256_BLOCK_SIZE - ctx->fill;
+    if (count > len)
+      count = len;
+    memcpy(ctx->block + ctx->fill, data, count);
+    ctx->fill += count;
+    data += count;
+    len -= count;
+    if (ctx->fill == SHA256_BLOCK_SIZE)
+    {
+      sha256_block(ctx, ctx->block);
+      ctx->fill = 0;
+    }
+  }
+}
+
+
+// Pad message and put SHA256_DIGEST_SIZE byte digest into digest
+void sha256_final(struct sha256 *ctx, unsigned char *digest)
+{
+  unsigned long long bits;
+  int i;
+
+  bits = ctx->length * 8;
+  ctx->block[ctx->fill++] = 0x80;
+  if (ctx->fill > SHA256_BLOCK_SIZE - 8)
+  {
+    memset(ctx->block + ctx->fill, 0, SHA256_BLOCK_SIZE - ctx->fill);
+    sha256_block(ctx, ctx->block);
+    ctx->fill = 0;
+  }
+  memset(ctx->block + ctx->fill, 0, SHA256_BLOCK_SIZE - 8 - ctx->fill);
+  for (i = 0; i < 8; i++)
+    ctx->block[SHA256_BLOCK_SIZE - 1 - i] = (bits >> (i * 8)) & 255;
+  sha256_block(ctx, ctx->block);
+
+  for (i = 0; i < 8; i++)
+  {
+    digest[i * 4] = (ctx->state[i] >> 24) & 255;
+    digest[i * 4 + 1] = (ctx->state[i] >> 16) & 255;
+    digest[i * 4 + 2] = (ctx->state[i] >> 8) & 255;
+    digest[i * 4 + 3] = ctx->state[i] & 255;
+  }
+}
+
+
+// Process one 64 byte block
+void sha256_block(struct sha256 *ctx, const unsigned char *block)
+{
+  unsigned long w[64];
+  unsigned long a, b, c, d, e, f, g, h;
+  unsigned long s0, s1, t1, t2;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    w[i] = ((unsigned long) block[i * 4] << 24) | (block[i * 4 + 1] << 16) |
+           (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+  for (i = 16; i < 64; i++)
+  {
+    s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = (w[i - 16] + s0 + w[i - 7] + s1) & MASK32;
+  }
+
+  a = ctx->state[0];
+  b = ctx->state[1];
+  c = ctx->state[2];
+  d = ctx->state[3];
+  e = ctx->state[4];
+  f = ctx->state[5];
+  g = ctx->state[6];
+  h = ctx->state[7];
+
+  for (i = 0; i < 64; i++)
+  {
+    s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+    t1 = (h + s1 + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i]) & MASK32;
+    s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+    t2 = (s0 + ((a & b) ^ (a & c) ^ (b & c))) & MASK32;
+    h = g;
+    g = f;
+    f = e;
+    e = (d + t1) & MASK32;
+    d = c;
+    c = b;
+    b = a;
+    a = (t1 + t2) & MASK32;
+  }
+
+  ctx->state[0] = (ctx->state[0] + a) & MASK32;
+  ctx->state[1] = (ctx->state[1] + b) & MASK32;
+  ctx->state[2] = (ctx->state[2] + c) & MASK32;
+  ctx->state[3] = (ctx->state[3] + d) & MASK32;
+  ctx->state[4] = (ctx->state[4] + e) & MASK32;
+  ctx->state[5] = (ctx->state[5] + f) & MASK32;
+  ctx->state[6] = (ctx->state[6] + g) & MASK32;
+  ctx->state[7] = (ctx->state[7] + h) & MASK32;
+}
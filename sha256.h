@@ -0,0 +1,17 @@
+// ** sha256.h - SHA-256 message digest (FIPS 180-4)
+// ** Used for sample store fingerprints
+
+#define SHA256_DIGEST_SIZE (32)
+#define SHA256_BLOCK_SIZE (64)
+
+struct sha256
+{
+  unsigned long state[8];                    // 32 bit words
+  unsigned long long length;                 // # bytes added
+  unsigned char block[SHA256_BLOCK_SIZE];
+  int fill;                                  // # bytes in block
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const unsigned char *data, long len);
+void sha256_final(struct sha256 *ctx, unsigned char *digest);
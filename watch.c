@@ -0,0 +1,478 @@
+// ** watch.c - es12wav watch mode
+// ** Convert ES-1 files as soon as they are complete in a spool directory
+// **
+// ** Files are picked up when closed after writing, or renamed into the
+// ** spool directory (names starting with '.' are ignored, so files can
+// ** be written under such a name and then renamed). Each file <name>.es1
+// ** is converted into directory <outdir>/<name> by a pool of threads,
+// ** fed through a bounded queue. Each file is converted into a new
+// ** hidden directory, which then replaces the output of any earlier
+// ** version of the file. Finished files are added to a journal in
+// ** outdir, one line per file:
+// **   <mtime> <ctime> <inode> <size> OK|FAILED <name>\n
+// ** with times in seconds and nanoseconds. Files in the spool directory
+// ** at startup that are in the journal with the same times, inode and
+// ** size are not converted again, so on restart only new or changed
+// ** files are converted. A file that was being converted when the
+// ** program stopped has no journal line, and is converted again. A file
+// ** written while watching is always converted.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "watch.h"
+
+
+#define JOURNAL_NAME ".es12wav-journal"
+
+// Max # of files waiting for a thread, and max # of threads
+#define QUEUE_SIZE (64)
+
+// Size of inotify event buffer
+#define EVENTBUF_SIZE (64 * (sizeof (struct inotify_event) + NAME_MAX + 1))
+
+// A converted (or failed) file, from the journal
+struct journalentry
+{
+  long mtime, mtime_nsec;
+  long ctime, ctime_nsec;
+  unsigned long inode;
+  long size;
+  char name[NAME_MAX + 1];
+};
+
+// State shared by the watching thread and the workers
+struct watchstate
+{
+  pthread_mutex_t lock;
+  pthread_cond_t notempty;
+  pthread_cond_t notfull;
+  char queue[QUEUE_SIZE][NAME_MAX + 1];
+  int written[QUEUE_SIZE];         // queued file was written, not found
+  int head;
+  int queued;
+  struct journalentry *journal;    // files done
+  int journalled;
+  int journalsize;
+  char busy[QUEUE_SIZE][NAME_MAX + 1]; // files being converted
+  int again[QUEUE_SIZE];           // busy file was written again
+  int spoolfd;
+  int outfd;
+  int journalfd;
+  convert_fn convert;
+};
+
+
+// Prototypes
+void *watch_worker(void *arg);
+void convert_spoolfile(struct watchstate *state, char *name, int written);
+int replace_outdir(int outfd, char *tmpname, char *name);
+void remove_outdir(int outfd, char *name);
+int read_journal(struct watchstate *state);
+int add_journal(struct watchstate *state, struct journalentry *entry);
+int find_journal(struct watchstate *state, struct journalentry *entry);
+void enqueue(struct watchstate *state, char *name, int written);
+int spool_name(char *name);
+
+
+// Code
+
+// Watch spooldir, converting new files into outdir with threads threads.
+// Only returns if there is an error.
+int run_watch(char *spooldir, char *outdir, int threads, convert_fn convert)
+{
+  static struct watchstate state;
+  struct inotify_event *event;
+  struct dirent *dirent;
+  pthread_t thread;
+  DIR *dir;
+  char *eventbuf;
+  char *p;
+  ssize_t len;
+  int inotifyfd;
+  int i;
+
+  if (threads > QUEUE_SIZE)
+    threads = QUEUE_SIZE;
+
+  memset(&state, 0, sizeof state);
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.notempty, NULL);
+  pthread_cond_init(&state.notfull, NULL);
+  state.convert = convert;
+
+  if (mkdir(outdir, 0777) < 0 && errno != EEXIST)
+  {
+    perror("Error creating output directory");
+    return 1;
+  }
+  state.spoolfd = open(spooldir, O_RDONLY | O_DIRECTORY);
+  state.outfd = open(outdir, O_RDONLY | O_DIRECTORY);
+  if (state.spoolfd < 0 || state.outfd < 0)
+  {
+    perror("Error opening directory");
+    return 1;
+  }
+  if (read_journal(&state) != 0)
+  {
+    perror("Error reading journal");
+    return 1;
+  }
+
+  // Watch before looking at what is there, so that nothing is missed
+  inotifyfd = inotify_init1(IN_CLOEXEC);
+  if (inotifyfd < 0 || 
+      inotify_add_watch(inotifyfd, spooldir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+  {
+    perror("Error watching spool directory");
+    return 1;
+  }
+  eventbuf = malloc(EVENTBUF_SIZE);
+  if (eventbuf == NULL)
+    return 1;
+
+  for (i = 0; i < threads; i++)
+  {
+    if (pthread_create(&thread, NULL, watch_worker, &state) != 0)
+    {
+      perror("Error creating thread");
+      return 1;
+    }
+    pthread_detach(thread);
+  }
+
+  // Files already in the spool directory; those in the journal are
+  // skipped by the workers
+  dir = fdopendir(dup(state.spoolfd));
+  while (dir != NULL && (dirent = readdir(dir)) != NULL)
+  {
+    if (spool_name(dirent->d_name))
+      enqueue(&state, dirent->d_name, 0);
+  }
+  if (dir != NULL)
+    closedir(dir);
+
+  printf("Watching %s\n", spooldir);
+  fflush(stdout);
+
+  for (;;)
+  {
+    len = read(inotifyfd, eventbuf, EVENTBUF_SIZE);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+    {
+      perror("Error reading inotify events");
+      return 1;
+    }
+    for (p = eventbuf; p < eventbuf + len; p += sizeof *event + event->len)
+    {
+      event = (struct inotify_event *) p;
+      if (event->len > 0 && spool_name(event->name))
+        enqueue(&state, event->name, 1);
+    }
+  }
+}
+
+
+// Worker thread: convert files from the queue
+void *watch_worker(void *arg)
+{
+  struct watchstate *state = arg;
+  char name[NAME_MAX + 1];
+  int written;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&state->lock);
+    while (state->queued == 0)
+      pthread_cond_wait(&state->notempty, &state->lock);
+    strcpy(name, state->queue[state->head]);
+    written = state->written[state->head];
+    state->head = (state->head + 1) % QUEUE_SIZE;
+    state->queued--;
+    pthread_cond_signal(&state->notfull);
+    pthread_mutex_unlock(&state->lock);
+
+    convert_spoolfile(state, name, written);
+  }
+  return NULL;
+}
+
+
+// Convert spool file name, unless it was found rather than written and
+// is in the journal, and add it to the journal. If another thread is
+// converting it, that thread converts it again when done instead.
+void convert_spoolfile(struct watchstate *state, char *name, int written)
+{
+  struct journalentry entry;
+  struct stat st;
+  char dirname[NAME_MAX + 1];
+  char tmpname[NAME_MAX + 32];
+  FILE *infile;
+  size_t len;
+  int slot;
+  int again;
+  int dirfd;
+  int fd;
+  int status;
+
+  fd = openat(state->spoolfd, name, O_RDONLY);
+  if (fd < 0)
+    return;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+  {
+    close(fd);
+    return;
+  }
+  entry.mtime = st.st_mtim.tv_sec;
+  entry.mtime_nsec = st.st_mtim.tv_nsec;
+  entry.ctime = st.st_ctim.tv_sec;
+  entry.ctime_nsec = st.st_ctim.tv_nsec;
+  entry.inode = st.st_ino;
+  entry.size = st.st_size;
+  strcpy(entry.name, name);
+
+  // Claim file, if not done or busy
+  pthread_mutex_lock(&state->lock);
+  slot = -1;
+  if (written || !find_journal(state, &entry))
+  {
+    for (slot = 0; slot < QUEUE_SIZE; slot++)
+    {
+      if (strcmp(state->busy[slot], name) == 0)
+      {
+        state->again[slot] = 1;
+        slot = -1;
+        break;
+      }
+    }
+    if (slot >= 0)
+    {
+      for (slot = 0; slot < QUEUE_SIZE && state->busy[slot][0] != '\0'; 
+           slot++)
+        ;
+      strcpy(state->busy[slot], name);
+      state->again[slot] = 0;
+    }
+  }
+  pthread_mutex_unlock(&state->lock);
+  if (slot < 0)
+  {
+    close(fd);
+    return;
+  }
+
+  // Output directory: name without .es1
+  strcpy(dirname, name);
+  len = strlen(dirname);
+  if (len > 4 && strcmp(dirname + len - 4, ".es1") == 0)
+    dirname[len - 4] = '\0';
+
+  // Convert into new hidden directory, so outputs of an earlier version
+  // are only replaced if conversion succeeds
+  snprintf(tmpname, sizeof tmpname, ".%s.%d.tmp", dirname, (int) getpid());
+  remove_outdir(state->outfd, tmpname);
+  status = 1;
+  infile = fdopen(fd, "rb");
+  if (infile == NULL)
+    close(fd);
+  else
+  {
+    if (mkdirat(state->outfd, tmpname, 0777) < 0)
+      status = 2;
+    else
+    {
+      dirfd = openat(state->outfd, tmpname, O_RDONLY | O_DIRECTORY);
+      if (dirfd >= 0)
+      {
+        status = state->convert(infile, dirfd);
+        close(dirfd);
+      }
+      if (status == 0)
+        status = replace_outdir(state->outfd, tmpname, dirname);
+      if (status != 0)
+        remove_outdir(state->outfd, tmpname);
+    }
+    fclose(infile);
+  }
+
+  printf("%s: %s\n", name, status == 0 ? "OK" : "FAILED");
+  fflush(stdout);
+
+  pthread_mutex_lock(&state->lock);
+  if (add_journal(state, &entry) != 0 ||
+      dprintf(state->journalfd, "%ld.%09ld %ld.%09ld %lu %ld %s %s\n", 
+              entry.mtime, entry.mtime_nsec, entry.ctime, entry.ctime_nsec,
+              entry.inode, entry.size, status == 0 ? "OK" : "FAILED", 
+              name) < 0)
+    perror("Error writing journal");
+  state->busy[slot][0] = '\0';
+  again = state->again[slot];
+  pthread_mutex_unlock(&state->lock);
+
+  if (again)
+    convert_spoolfile(state, name, 1);
+}
+
+
+// Rename output directory tmpname in outfd to name, replacing any
+// directory name. Return 2 if error, else 0.
+int replace_outdir(int outfd, char *tmpname, char *name)
+{
+  if (renameat2(outfd, tmpname, outfd, name, RENAME_NOREPLACE) == 0)
+    return 0;
+  if (errno != EEXIST)
+    return 2;
+
+  // Swap in one go, so name always has complete outputs, then remove
+  // the old ones, now under tmpname
+  if (renameat2(outfd, tmpname, outfd, name, RENAME_EXCHANGE) != 0)
+    return 2;
+  remove_outdir(outfd, tmpname);
+  return 0;
+}
+
+
+// Remove output directory name in outfd, if it exists, and the files
+// in it (output directories have no subdirectories)
+void remove_outdir(int outfd, char *name)
+{
+  struct dirent *dirent;
+  DIR *dir;
+  int fd;
+
+  fd = openat(outfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+  if (fd < 0)
+    return;
+  dir = fdopendir(fd);
+  if (dir == NULL)
+  {
+    close(fd);
+    return;
+  }
+  while ((dirent = readdir(dir)) != NULL)
+  {
+    if (strcmp(dirent->d_name, ".") != 0 && strcmp(dirent->d_name, "..") != 0)
+      unlinkat(fd, dirent->d_name, 0);
+  }
+  closedir(dir);
+  unlinkat(outfd, name, AT_REMOVEDIR);
+}
+
+
+// Read journal in outdir, and open it for appending.
+// Return 1 if error, else 0.
+int read_journal(struct watchstate *state)
+{
+  struct journalentry entry;
+  char line[NAME_MAX + 128];
+  char result[16];
+  FILE *journal;
+  size_t len;
+  int namepos;
+  int fd;
+
+  fd = openat(state->outfd, JOURNAL_NAME, O_RDONLY);
+  if (fd >= 0)
+  {
+    journal = fdopen(fd, "r");
+    if (journal == NULL)
+      return 1;
+    while (fgets(line, sizeof line, journal) != NULL)
+    {
+      len = strlen(line);
+      if (len > 0 && line[len - 1] == '\n')
+        line[len - 1] = '\0';
+      if (sscanf(line, "%ld.%ld %ld.%ld %lu %ld %15s %n", &entry.mtime,
+                 &entry.mtime_nsec, &entry.ctime, &entry.ctime_nsec,
+                 &entry.inode, &entry.size, result, &namepos) == 7 && 
+          strlen(line + namepos) <= NAME_MAX)
+      {
+        strcpy(entry.name, line + namepos);
+        if (add_journal(state, &entry) != 0)
+          return 1;
+      }
+    }
+    fclose(journal);
+  }
+
+  state->journalfd = openat(state->outfd, JOURNAL_NAME,
+                            O_WRONLY | O_CREAT | O_APPEND, 0666);
+  return state->journalfd < 0;
+}
+
+
+// Add entry to journal entries in memory. Return 1 if no memory, else 0.
+int add_journal(struct watchstate *state, struct journalentry *entry)
+{
+  struct journalentry *journal;
+
+  if (state->journalled == state->journalsize)
+  {
+    journal = realloc(state->journal, (state->journalsize * 2 + 16) * 
+                                      sizeof *journal);
+    if (journal == NULL)
+      return 1;
+    state->journal = journal;
+    state->journalsize = state->journalsize * 2 + 16;
+  }
+  state->journal[state->journalled++] = *entry;
+  return 0;
+}
+
+
+// Return 1 if file in entry is in the journal with same times, inode
+// and size
+int find_journal(struct watchstate *state, struct journalentry *entry)
+{
+  struct journalentry *j;
+  int i;
+
+  for (i = state->journalled - 1; i >= 0; i--)
+  {
+    j = &state->journal[i];
+    if (strcmp(j->name, entry->name) == 0)
+      return j->mtime == entry->mtime && 
+             j->mtime_nsec == entry->mtime_nsec &&
+             j->ctime == entry->ctime && 
+             j->ctime_nsec == entry->ctime_nsec &&
+             j->inode == entry->inode && j->size == entry->size;
+  }
+  return 0;
+}
+
+
+// Add file name to queue, waiting while it is full. written is 1 if the
+// file was just written, so is to be converted even if in the journal.
+void enqueue(struct watchstate *state, char *name, int written)
+{
+  int tail;
+
+  pthread_mutex_lock(&state->lock);
+  while (state->queued == QUEUE_SIZE)
+    pthread_cond_wait(&state->notfull, &state->lock);
+  tail = (state->head + state->queued) % QUEUE_SIZE;
+  strcpy(state->queue[tail], name);
+  state->written[tail] = written;
+  state->queued++;
+  pthread_cond_signal(&state->notempty);
+  pthread_mutex_unlock(&state->lock);
+}
+
+
+// Return 1 if name is to be converted, i.e. not hidden or temporary
+int spool_name(char *name)
+{
+  return name[0] != '.' && strlen(name) <= NAME_MAX;
+}
@@ -0,0 +1,8 @@
+// ** watch.h - es12wav watch mode
+// ** Convert ES-1 files as soon as they are complete in a spool directory
+
+// Conversion of infile to output files in directory dirfd,
+// e.g. process_file()
+typedef int (*convert_fn)(FILE *infile, int dirfd);
+
+int run_watch(char *spooldir, char *outdir, int threads, convert_fn convert);